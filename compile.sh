@@ -1,4 +1,4 @@
-g++-9 main.cpp -o vptree -O3 -fopenmp -std=c++17 \
+g++-11 main.cpp -o vptree -O3 -fopenmp -std=c++17 \
 -I/home/arai/workspace/json/single_include \
 -I/home/arai/workspace/arailib/include \
 -I./
\ No newline at end of file
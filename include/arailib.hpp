@@ -8,14 +8,25 @@
 #include <algorithm>
 #include <iterator>
 #include <numeric>
+#include <limits>
 #include <cmath>
 #include <fstream>
 #include <sstream>
 #include <chrono>
 #include <exception>
 #include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <charconv>
+#include <typeinfo>
 #include <omp.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <json.hpp>
+#include <simd.hpp>
 
 using namespace std;
 using namespace nlohmann;
@@ -35,6 +46,20 @@ namespace arailib {
         return result;
     }
 
+    // converts a value to element type T; integer types get the nearest value, clamped to their
+    // range (NaN becomes 0), instead of the truncation and undefined overflow of a plain static_cast
+    template <typename T, typename U>
+    T saturate_cast(U value) {
+        if constexpr (is_integral<T>::value && !is_same<T, U>::value) {
+            const double x = std::round(static_cast<double>(value));
+            if (std::isnan(x)) return 0;
+            return static_cast<T>(std::clamp(x, static_cast<double>(numeric_limits<T>::lowest()),
+                                             static_cast<double>(numeric_limits<T>::max())));
+        } else {
+            return static_cast<T>(value);
+        }
+    }
+
     template <typename T = float>
     struct Data {
         size_t id;
@@ -88,35 +113,98 @@ namespace arailib {
     using SeriesList = vector<vector<Data<T>>>;
 
     template <typename T = float>
-    using DistanceFunction = function<float(Data<T>, Data<T>)>;
+    using DistanceFunction = float (*)(const T*, const T*, size_t);
+
+    // distance that may stop early once it is known to exceed a bound (the last argument)
+    template <typename T = float>
+    using BoundedDistanceFunction = float (*)(const T*, const T*, size_t, float);
+
+    // bounded distances from one vector to n_rows vectors stored stride values apart, into the last argument
+    template <typename T = float>
+    using RowsDistanceFunction = void (*)(const T*, const T*, size_t, size_t, size_t, float, float*);
+
+    // float kernels can be specialized for a dimension known at compile time (see simd::active).
+    // the distance functions take it as Dim; 0 means any dimension.
+    template <typename T, size_t Dim>
+    constexpr bool has_fixed_kernels = Dim > 0 && is_same<T, float>::value;
+
+    template <typename T = float, size_t Dim = 0>
+    float euclidean_distance(const T* p1, const T* p2, size_t n) {
+        if constexpr (has_fixed_kernels<T, Dim>) return std::sqrt(simd::active<Dim>().l2_sqr(p1, p2, Dim));
+        else return std::sqrt(simd::l2_sqr(p1, p2, n));
+    }
 
     template <typename T = float>
     auto euclidean_distance(const Data<T>& p1, const Data<T>& p2) {
-        float result = 0;
-        for (size_t i = 0; i < p1.size(); i++) {
-            result += std::pow(p1[i] - p2[i], 2);
+        return euclidean_distance(p1.x.data(), p2.x.data(), p1.size());
+    }
+
+    // euclidean_distance if it is at most bound, otherwise infinity
+    template <typename T = float, size_t Dim = 0>
+    float euclidean_distance_bounded(const T* p1, const T* p2, size_t n, float bound) {
+        float sum;
+        if constexpr (has_fixed_kernels<T, Dim>) sum = simd::bounded_fixed<Dim>(&simd::Kernels::l2_sqr, p1, p2, bound * bound);
+        else sum = simd::l2_sqr_bounded(p1, p2, n, bound * bound);
+        return sum > bound * bound ? numeric_limits<float>::infinity() : std::sqrt(sum);
+    }
+
+    // euclidean_distance_bounded from p1 to each of n_rows vectors starting at rows, stride values apart.
+    // float vectors go through the one-to-many kernels (see simd::rows_active).
+    template <typename T = float, size_t Dim = 0>
+    void euclidean_distance_rows(const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n,
+                                 float bound, float* out) {
+        if constexpr (is_same<T, float>::value) {
+            simd::rows_active<Dim>().l2_sqr(p1, rows, stride, n_rows, n, bound * bound, out);
+            for (size_t r = 0; r < n_rows; r++) {
+                out[r] = out[r] > bound * bound ? numeric_limits<float>::infinity() : std::sqrt(out[r]);
+            }
+        } else {
+            for (size_t r = 0; r < n_rows; r++) out[r] = euclidean_distance_bounded<T, Dim>(p1, rows + r * stride, n, bound);
         }
-        result = std::sqrt(result);
-        return result;
+    }
+
+    template <typename T = float, size_t Dim = 0>
+    float manhattan_distance(const T* p1, const T* p2, size_t n) {
+        if constexpr (has_fixed_kernels<T, Dim>) return simd::active<Dim>().l1(p1, p2, Dim);
+        else return simd::l1(p1, p2, n);
     }
 
     template <typename T = float>
     auto manhattan_distance(const Data<T>& p1, const Data<T>& p2) {
-        float result = 0;
-        for (size_t i = 0; i < p1.size(); i++) {
-            result += std::abs(p1[i] - p2[i]);
+        return manhattan_distance(p1.x.data(), p2.x.data(), p1.size());
+    }
+
+    // manhattan_distance if it is at most bound, otherwise infinity
+    template <typename T = float, size_t Dim = 0>
+    float manhattan_distance_bounded(const T* p1, const T* p2, size_t n, float bound) {
+        float sum;
+        if constexpr (has_fixed_kernels<T, Dim>) sum = simd::bounded_fixed<Dim>(&simd::Kernels::l1, p1, p2, bound);
+        else sum = simd::l1_bounded(p1, p2, n, bound);
+        return sum > bound ? numeric_limits<float>::infinity() : sum;
+    }
+
+    // manhattan_distance_bounded from p1 to each of n_rows vectors, as euclidean_distance_rows
+    template <typename T = float, size_t Dim = 0>
+    void manhattan_distance_rows(const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n,
+                                 float bound, float* out) {
+        if constexpr (is_same<T, float>::value) {
+            simd::rows_active<Dim>().l1(p1, rows, stride, n_rows, n, bound, out);
+            for (size_t r = 0; r < n_rows; r++) {
+                if (out[r] > bound) out[r] = numeric_limits<float>::infinity();
+            }
+        } else {
+            for (size_t r = 0; r < n_rows; r++) out[r] = manhattan_distance_bounded<T, Dim>(p1, rows + r * stride, n, bound);
         }
-        return result;
+    }
+
+    template <typename T = float>
+    float l2_norm(const T* p, size_t n) {
+        return std::sqrt(simd::dot(p, p, n));
     }
 
     template <typename T = float>
     auto l2_norm(const Data<T>& p) {
-        float result = 0;
-        for (size_t i = 0; i < p.size(); i++) {
-            result += std::pow(p[i], 2);
-        }
-        result = std::sqrt(result);
-        return result;
+        return l2_norm(p.x.data(), p.size());
     }
 
     template <typename T = float>
@@ -124,27 +212,288 @@ namespace arailib {
         return max(min(val, max_val), min_val);
     }
 
+    template <typename T = float, size_t Dim = 0>
+    float cosine_similarity(const T* p1, const T* p2, size_t n) {
+        float cosine;
+        if constexpr (has_fixed_kernels<T, Dim>) cosine = simd::active<Dim>().cosine(p1, p2, Dim);
+        else cosine = simd::cosine(p1, p2, n);
+        return clip(cosine, static_cast<float>(-1), static_cast<float>(1));
+    }
+
     template <typename T = float>
     auto cosine_similarity(const Data<T>& p1, const Data<T>& p2) {
-        float val = inner_product(p1.begin(), p1.end(), p2.begin(), 0.0)
-            / (l2_norm(p1) * l2_norm(p2));
-        return clip(val, static_cast<float>(-1), static_cast<float>(1));
+        return cosine_similarity(p1.x.data(), p2.x.data(), p1.size());
     }
 
     constexpr float pi = static_cast<const float>(3.14159265358979323846264338);
 
+    template <typename T = float, size_t Dim = 0>
+    float angular_distance(const T* p1, const T* p2, size_t n) {
+        return acos(cosine_similarity<T, Dim>(p1, p2, n)) / pi;
+    }
+
     template <typename T = float>
     float angular_distance(const Data<T>& p1, const Data<T>& p2) {
-        return acos(cosine_similarity(p1, p2)) / pi;
+        return angular_distance(p1.x.data(), p2.x.data(), p1.size());
     }
 
-    auto select_distance(const string& distance) {
-        if (distance == "euclidean") return euclidean_distance<float>;
-        if (distance == "manhattan") return manhattan_distance<float>;
-        if (distance == "angular")   return angular_distance<float>;
+    // angular_distance of unit-length vectors, from a single dot product
+    template <typename T = float, size_t Dim = 0>
+    float unit_angular_distance(const T* p1, const T* p2, size_t n) {
+        float dot;
+        if constexpr (has_fixed_kernels<T, Dim>) dot = simd::active<Dim>().dot(p1, p2, Dim);
+        else dot = simd::dot(p1, p2, n);
+        return acos(clip(dot, static_cast<float>(-1), static_cast<float>(1))) / pi;
+    }
+
+    // scales p to unit length in place; zero vectors are left as they are
+    template <typename T = float>
+    void normalize(T* p, size_t n) {
+        const auto norm = l2_norm(p, n);
+        if (norm == 0) return;
+        for (size_t i = 0; i < n; i++) p[i] /= norm;
+    }
+
+    template <typename T = float>
+    DistanceFunction<T> select_distance(const string& distance) {
+        if (distance == "euclidean") return euclidean_distance<T>;
+        if (distance == "manhattan") return manhattan_distance<T>;
+        if (distance == "angular")   return angular_distance<T>;
         else throw runtime_error("invalid distance");
     }
 
+    // metric functors for compile-time selection of the distance.
+    // any type with the same call operator can be used as a user-defined metric.
+    // with Dim > 0 the metric only accepts vectors of Dim values, and uses kernels specialized for it;
+    // dim tells the trees to check their points against it.
+    template <typename T = float, size_t Dim = 0>
+    struct Euclidean {
+        static constexpr size_t dim = Dim;
+        static constexpr const char* name = "euclidean";
+
+        float operator()(const T* p1, const T* p2, size_t n) const {
+            return euclidean_distance<T, Dim>(p1, p2, n);
+        }
+
+        float bounded(const T* p1, const T* p2, size_t n, float bound) const {
+            return euclidean_distance_bounded<T, Dim>(p1, p2, n, bound);
+        }
+
+        void rows(const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n, float bound, float* out) const {
+            euclidean_distance_rows<T, Dim>(p1, rows, stride, n_rows, n, bound, out);
+        }
+    };
+
+    template <typename T = float, size_t Dim = 0>
+    struct Manhattan {
+        static constexpr size_t dim = Dim;
+        static constexpr const char* name = "manhattan";
+
+        float operator()(const T* p1, const T* p2, size_t n) const {
+            return manhattan_distance<T, Dim>(p1, p2, n);
+        }
+
+        float bounded(const T* p1, const T* p2, size_t n, float bound) const {
+            return manhattan_distance_bounded<T, Dim>(p1, p2, n, bound);
+        }
+
+        void rows(const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n, float bound, float* out) const {
+            manhattan_distance_rows<T, Dim>(p1, rows, stride, n_rows, n, bound, out);
+        }
+    };
+
+    template <typename T = float, size_t Dim = 0>
+    struct Angular {
+        static constexpr size_t dim = Dim;
+        static constexpr const char* name = "angular";
+
+        float operator()(const T* p1, const T* p2, size_t n) const {
+            return angular_distance<T, Dim>(p1, p2, n);
+        }
+    };
+
+    // a metric whose normalized() returns true only accepts unit-length vectors;
+    // the trees normalize their points at build time and every query before searching.
+    template <typename T = float, size_t Dim = 0>
+    struct UnitAngular {
+        static constexpr size_t dim = Dim;
+        static constexpr const char* name = "angular";
+
+        float operator()(const T* p1, const T* p2, size_t n) const {
+            return unit_angular_distance<T, Dim>(p1, p2, n);
+        }
+
+        bool normalized() const { return true; }
+    };
+
+    // metric selected at runtime by name through select_distance.
+    // for float vectors, "angular" uses the unit-vector kernel, like UnitAngular.
+    template <typename T = float>
+    struct BasicDynamicDistance {
+        DistanceFunction<T> f;
+        BoundedDistanceFunction<T> b = nullptr;  // early-abandoning f, if there is one
+        RowsDistanceFunction<T> r = nullptr;     // b from one point to many, if there is one
+        bool unit = false;
+        string name;
+
+        BasicDynamicDistance(const string& distance = "euclidean") :
+            f(select_distance<T>(distance)), unit(is_same<T, float>::value && distance == "angular"), name(distance) {
+            if (unit) f = unit_angular_distance<T>;
+            if (distance == "euclidean") b = euclidean_distance_bounded<T>, r = euclidean_distance_rows<T>;
+            if (distance == "manhattan") b = manhattan_distance_bounded<T>, r = manhattan_distance_rows<T>;
+        }
+        BasicDynamicDistance(const char* distance) : BasicDynamicDistance(string(distance)) {}
+
+        float operator()(const T* p1, const T* p2, size_t n) const {
+            return f(p1, p2, n);
+        }
+
+        float bounded(const T* p1, const T* p2, size_t n, float bound) const {
+            return b ? b(p1, p2, n, bound) : f(p1, p2, n);
+        }
+
+        void rows(const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n, float bound, float* out) const {
+            if (r) r(p1, rows, stride, n_rows, n, bound, out);
+            else for (size_t i = 0; i < n_rows; i++) out[i] = bounded(p1, rows + i * stride, n, bound);
+        }
+
+        bool normalized() const { return unit; }
+    };
+
+    using DynamicDistance = BasicDynamicDistance<>;
+
+    template <typename Metric>
+    auto is_normalized(const Metric& df, int) -> decltype(df.normalized()) { return df.normalized(); }
+
+    template <typename Metric>
+    bool is_normalized(const Metric&, long) { return false; }
+
+    // whether df expects unit-length vectors (see UnitAngular)
+    template <typename Metric>
+    bool is_normalized(const Metric& df) { return is_normalized(df, 0); }
+
+    template <typename Metric>
+    auto metric_name(const Metric& df, int) -> decltype(string(df.name)) { return df.name; }
+
+    template <typename Metric>
+    string metric_name(const Metric&, long) { return typeid(Metric).name(); }
+
+    // name of the distance df computes: its name member ("euclidean" for both Euclidean<> and
+    // DynamicDistance("euclidean")), or the type name of a user-defined metric without one
+    template <typename Metric>
+    string metric_name(const Metric& df) { return metric_name(df, 0); }
+
+    // dimension a metric is specialized for (see Euclidean), 0 if it accepts any
+    template <typename Metric, typename = void>
+    struct fixed_dim : integral_constant<size_t, 0> {};
+
+    template <typename Metric>
+    struct fixed_dim<Metric, void_t<decltype(Metric::dim)>> : integral_constant<size_t, Metric::dim> {};
+
+    template <typename Metric, typename T>
+    auto bounded_distance(const Metric& df, const T* p1, const T* p2, size_t n, float bound, int)
+        -> decltype(df.bounded(p1, p2, n, bound)) { return df.bounded(p1, p2, n, bound); }
+
+    template <typename Metric, typename T>
+    float bounded_distance(const Metric& df, const T* p1, const T* p2, size_t n, float, long) { return df(p1, p2, n); }
+
+    // df(p1, p2, n) if it is below bound; otherwise any value >= bound.
+    // metrics with a bounded() member (like Euclidean) stop summing early; others compute the full distance.
+    template <typename Metric, typename T>
+    float bounded_distance(const Metric& df, const T* p1, const T* p2, size_t n, float bound) {
+        return bounded_distance(df, p1, p2, n, bound, 0);
+    }
+
+    template <typename Metric, typename T>
+    auto rows_distance(const Metric& df, const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n,
+                       float bound, float* out, int) -> decltype(df.rows(p1, rows, stride, n_rows, n, bound, out)) {
+        df.rows(p1, rows, stride, n_rows, n, bound, out);
+    }
+
+    template <typename Metric, typename T>
+    void rows_distance(const Metric& df, const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n,
+                       float bound, float* out, long) {
+        for (size_t r = 0; r < n_rows; r++) out[r] = bounded_distance(df, p1, rows + r * stride, n, bound);
+    }
+
+    // bounded_distance from p1 to each of n_rows vectors starting at rows, stride values apart, into out.
+    // metrics with a rows() member (like Euclidean) measure them together; others one at a time.
+    template <typename Metric, typename T>
+    void rows_distance(const Metric& df, const T* p1, const T* rows, size_t stride, size_t n_rows, size_t n,
+                       float bound, float* out) {
+        rows_distance(df, p1, rows, stride, n_rows, n, bound, out, 0);
+    }
+
+    // read-only memory mapping of a whole file.
+    // populate pre-faults every page (MAP_POPULATE); otherwise pages are read on first access.
+    struct MappedFile {
+        MappedFile() = default;
+
+        explicit MappedFile(const string& path, bool populate = false) {
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw runtime_error("Can't open file!");
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw runtime_error("Can't stat file!");
+            }
+            length = static_cast<size_t>(st.st_size);
+            if (length > 0) {
+                int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+                if (populate) flags |= MAP_POPULATE;
+#endif
+                void* p = ::mmap(nullptr, length, PROT_READ, flags, fd, 0);
+                if (p == MAP_FAILED) {
+                    ::close(fd);
+                    throw runtime_error("Can't map file!");
+                }
+                addr = static_cast<const char*>(p);
+                advise(populate ? MADV_WILLNEED : MADV_NORMAL);
+            }
+            ::close(fd);
+        }
+
+        MappedFile(MappedFile&& o) noexcept : addr(o.addr), length(o.length) {
+            o.addr = nullptr;
+            o.length = 0;
+        }
+
+        MappedFile& operator=(MappedFile&& o) noexcept {
+            if (this != &o) {
+                unmap();
+                addr = o.addr;
+                length = o.length;
+                o.addr = nullptr;
+                o.length = 0;
+            }
+            return *this;
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() { unmap(); }
+
+        const char* data() const { return addr; }
+        size_t size() const { return length; }
+
+        // madvise hint for the whole mapping, e.g. MADV_RANDOM or MADV_WILLNEED
+        void advise(int advice) const {
+            if (addr) ::madvise(const_cast<char*>(addr), length, advice);
+        }
+
+    private:
+        const char* addr = nullptr;
+        size_t length = 0;
+
+        void unmap() {
+            if (addr) ::munmap(const_cast<char*>(addr), length);
+            addr = nullptr;
+            length = 0;
+        }
+    };
+
     template <typename T = float>
     vector<T> split(string &input, char delimiter = ',') {
         std::istringstream stream(input);
@@ -177,37 +526,392 @@ namespace arailib {
 
     const int n_max_threads = omp_get_max_threads();
 
+    // n points of dimension dim stored row-major in one flat buffer
     template <typename T = float>
-    Series<T> load_data(const string& path, int n = 0) {
-        // file path
-        if (path.rfind(".csv", path.size()) < path.size()) {
-            auto series = Series<T>();
-            ifstream ifs(path);
-            if (!ifs) throw runtime_error("Can't open file!");
-            string line;
-            for (size_t i = 0; (i < n) && std::getline(ifs, line); ++i) {
-                auto v = split(line);
-                series.push_back(Data<T>(i, v));
+    struct Matrix {
+        size_t n = 0;
+        size_t dim = 0;
+        vector<T> values;
+        vector<size_t> ids;
+
+        void allocate(size_t n_rows, size_t n_dim) {
+            n = n_rows;
+            dim = n_dim;
+            values.assign(n * dim, T());
+            ids.assign(n, 0);
+        }
+
+        size_t size() const { return n; }
+        T* row(size_t i) { return values.data() + i * dim; }
+        const T* row(size_t i) const { return values.data() + i * dim; }
+
+        Series<T> to_series() const {
+            Series<T> series(n);
+            for (size_t i = 0; i < n; i++) {
+                series[i].id = ids[i];
+                series[i].x.assign(row(i), row(i) + dim);
             }
             return series;
         }
+    };
 
-        // dir path
-        auto series = Series<T>(n * 1000);
-#pragma omp parallel for
-        for (int i = 0; i < n; i++) {
-            const string data_path = path + '/' + to_string(i) + ".csv";
-            ifstream ifs(data_path);
+    // parses one CSV line of exactly dim numbers into out; false if malformed
+    template <typename T = float>
+    bool parse_csv_line(const char* p, const char* end, size_t dim, T* out) {
+        if (end > p && end[-1] == '\r') --end;
+        for (size_t j = 0; j < dim; j++) {
+            while (p < end && *p == ' ') ++p;
+            if (p < end && *p == '+') ++p;
+            const auto parsed = from_chars(p, end, out[j]);
+            if (parsed.ec != errc()) return false;
+            p = parsed.ptr;
+            while (p < end && *p == ' ') ++p;
+            if (j + 1 < dim) {
+                if (p == end || *p != ',') return false;
+                ++p;
+            }
+        }
+        return p == end;
+    }
+
+    // reads the first nrows lines (all lines if nrows < 0) of a numeric CSV file.
+    // the file is mapped and split into byte ranges at line boundaries, which are counted
+    // and then parsed in parallel straight into a preallocated matrix. ids are line numbers.
+    // floating-point from_chars needs GCC 11 (libstdc++ 11) or later.
+    template <typename T = float>
+    Matrix<T> parse_csv(const string& path, const long long nrows = -1) {
+        const MappedFile file(path);
+        const char* data = file.data();
+        size_t size = file.size();
+
+        Matrix<T> matrix;
+        if (size == 0 || nrows == 0) return matrix;
+
+        // only the first nrows lines are split up, counted and parsed
+        if (nrows > 0) {
+            const char* p = data;
+            for (long long line = 0; line < nrows && p < data + size; line++) {
+                const auto* newline = static_cast<const char*>(memchr(p, '\n', data + size - p));
+                p = newline ? newline + 1 : data + size;
+            }
+            size = p - data;
+        }
+
+        // dimension from the first line
+        const char* first_end = static_cast<const char*>(memchr(data, '\n', size));
+        if (!first_end) first_end = data + size;
+        matrix.dim = count(data, first_end, ',') + 1;
+
+        // chunk boundaries at line starts
+        const size_t n_chunks = min<size_t>(size / (1 << 16) + 1, n_max_threads * 4);
+        vector<size_t> chunk_begin(n_chunks + 1, size);
+        for (size_t c = 0; c < n_chunks; c++) {
+            size_t begin = size / n_chunks * c;
+            if (begin > 0) {
+                const auto* newline = static_cast<const char*>(memchr(data + begin - 1, '\n', size - begin + 1));
+                begin = newline ? newline - data + 1 : size;
+            }
+            chunk_begin[c] = begin;
+        }
+
+        // count lines, then number them
+        vector<size_t> chunk_lines(n_chunks + 1, 0);
+#pragma omp parallel for schedule(static, 1)
+        for (size_t c = 0; c < n_chunks; c++) {
+            const char* p = data + chunk_begin[c];
+            const char* end = data + chunk_begin[c + 1];
+            size_t lines = 0;
+            while (p < end) {
+                const auto* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+                ++lines;
+                p = newline ? newline + 1 : end;
+            }
+            chunk_lines[c + 1] = lines;
+        }
+        partial_sum(chunk_lines.begin(), chunk_lines.end(), chunk_lines.begin());
+
+        matrix.n = chunk_lines[n_chunks];
+        if (nrows >= 0) matrix.n = min<size_t>(matrix.n, nrows);
+        matrix.values.resize(matrix.n * matrix.dim);
+        matrix.ids.resize(matrix.n);
+
+        // parse; errors are collected and reported after the parallel region
+        vector<size_t> bad_line(n_chunks, SIZE_MAX);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t c = 0; c < n_chunks; c++) {
+            const char* p = data + chunk_begin[c];
+            const char* end = data + chunk_begin[c + 1];
+            for (size_t line = chunk_lines[c]; p < end && line < matrix.n; line++) {
+                const auto* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+                const char* line_end = newline ? newline : end;
+                if (!parse_csv_line(p, line_end, matrix.dim, matrix.row(line))) {
+                    bad_line[c] = line;
+                    break;
+                }
+                matrix.ids[line] = line;
+                p = newline ? newline + 1 : end;
+            }
+        }
+        const auto bad = *min_element(bad_line.begin(), bad_line.end());
+        if (bad != SIZE_MAX) throw runtime_error(path + ": malformed line " + to_string(bad + 1));
+
+        return matrix;
+    }
+
+    bool has_extension(const string& path, const string& extension) {
+        return path.size() >= extension.size() &&
+               path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    bool is_vecs(const string& path) {
+        return has_extension(path, ".fvecs") || has_extension(path, ".bvecs") ||
+               has_extension(path, ".ivecs");
+    }
+
+    // reader for the TEXMEX vector formats: every row is an int32 dimension followed by
+    // dim values, float for .fvecs, uint8 for .bvecs and int32 for .ivecs (e.g. ground truth).
+    // rows are read in bulk and converted to T; ids are row numbers in the file.
+    template <typename T = float>
+    struct VecsReader {
+        VecsReader(const string& path) : ifs(path, ios::binary) {
             if (!ifs) throw runtime_error("Can't open file!");
-            string line;
-            while(getline(ifs, line)) {
-                auto v = split(line);
-                const auto id = static_cast<size_t>(v[0]);
-                v.erase(v.begin());
-                series[id] = Data<T>(id, v);
+            if (has_extension(path, ".fvecs")) format = 'f', value_size = sizeof(float);
+            else if (has_extension(path, ".bvecs")) format = 'b', value_size = sizeof(uint8_t);
+            else if (has_extension(path, ".ivecs")) format = 'i', value_size = sizeof(int32_t);
+            else throw runtime_error("unknown vecs format");
+
+            ifs.seekg(0, ios::end);
+            const auto file_size = static_cast<size_t>(ifs.tellg());
+            ifs.seekg(0);
+            int32_t d = 0;
+            if (file_size > 0 && !ifs.read(reinterpret_cast<char*>(&d), sizeof(d)))
+                throw runtime_error("truncated vecs file");
+            if (d < 0) throw runtime_error("invalid vecs dimension");
+            n_dim = static_cast<size_t>(d);
+            row_size = sizeof(int32_t) + n_dim * value_size;
+            if (file_size % row_size != 0) throw runtime_error("truncated vecs file");
+            n_rows = file_size / row_size;
+        }
+
+        size_t size() const { return n_rows; }
+        size_t dim() const { return n_dim; }
+
+        // rows [offset, offset + n), clipped to the end of the file
+        Series<T> read(size_t offset = 0, size_t n = SIZE_MAX) {
+            Series<T> series;
+            for_each_block(block_rows, [&](Series<T>& block) {
+                move(block.begin(), block.end(), back_inserter(series));
+            }, offset, n);
+            return series;
+        }
+
+        // streams rows [offset, offset + n) to f(Series<T>&) in blocks of block_size rows
+        template <typename F>
+        void for_each_block(size_t block_size, F f, size_t offset = 0, size_t n = SIZE_MAX) {
+            const auto begin = min(offset, n_rows);
+            const auto end = begin + min(n, n_rows - begin);
+            block_size = max<size_t>(block_size, 1);
+
+            vector<char> bytes;
+            ifs.clear();
+            ifs.seekg(begin * row_size);
+            for (size_t block_begin = begin; block_begin < end; block_begin += block_size) {
+                const auto count = min(block_size, end - block_begin);
+                bytes.resize(count * row_size);
+                if (!ifs.read(bytes.data(), bytes.size())) throw runtime_error("truncated vecs file");
+
+                Series<T> block(count);
+                for (size_t i = 0; i < count; i++) {
+                    const char* row = bytes.data() + i * row_size;
+                    int32_t d;
+                    memcpy(&d, row, sizeof(d));
+                    if (static_cast<size_t>(d) != n_dim) throw runtime_error("dimension mismatch");
+                    block[i].id = block_begin + i;
+                    block[i].x.resize(n_dim);
+                    convert(row + sizeof(int32_t), block[i].x.data());
+                }
+                f(block);
             }
         }
-        return series;
+
+    private:
+        static constexpr size_t block_rows = 1 << 14;
+        ifstream ifs;
+        size_t value_size = 0;
+        char format = 0;
+        size_t n_dim = 0;
+        size_t row_size = 0;
+        size_t n_rows = 0;
+
+        template <typename V>
+        void convert_as(const char* values, T* out) const {
+            if constexpr (is_same<V, T>::value) {
+                memcpy(out, values, n_dim * sizeof(V));
+                return;
+            }
+            for (size_t j = 0; j < n_dim; j++) {
+                V v;
+                memcpy(&v, values + j * sizeof(V), sizeof(V));
+                out[j] = saturate_cast<T>(v);
+            }
+        }
+
+        void convert(const char* values, T* out) const {
+            if (format == 'f') convert_as<float>(values, out);
+            else if (format == 'b') convert_as<uint8_t>(values, out);
+            else convert_as<int32_t>(values, out);
+        }
+    };
+
+    // first n rows (all rows if n < 0) of a .fvecs/.bvecs/.ivecs file, starting at row offset
+    template <typename T = float>
+    Series<T> read_vecs(const string& path, int n = -1, size_t offset = 0) {
+        VecsReader<T> reader(path);
+        return reader.read(offset, n >= 0 ? static_cast<size_t>(n) : SIZE_MAX);
+    }
+
+    // number of consecutive shards path/0.csv, path/1.csv, ... that exist
+    size_t count_shards(const string& path) {
+        size_t n = 0;
+        struct stat st;
+        while (stat((path + '/' + to_string(n) + ".csv").c_str(), &st) == 0) ++n;
+        return n;
+    }
+
+    // number of lines in data; a final line without a newline counts
+    size_t count_lines(const char* data, size_t size) {
+        size_t lines = 0;
+        const char* p = data;
+        const char* end = data + size;
+        while (p < end) {
+            const auto* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+            ++lines;
+            p = newline ? newline + 1 : end;
+        }
+        return lines;
+    }
+
+    // reads the directory layout path/0.csv ... path/{n_shards - 1}.csv, where every line is
+    // "id,x0,x1,...", into rows: any row store with allocate(n, dim), row(i) and ids, such as Matrix.
+    // n_shards < 0 reads every shard present (see count_shards). shards are mapped and their lines
+    // counted first, so rows is sized exactly once; then shards are parsed in parallel into their slices of it.
+    // values are parsed as V, and converted with saturate_cast if rows stores another type.
+    // on_shard(rows, begin, end) is called from the parsing thread as soon as rows [begin, end) are filled,
+    // so calls for different shards may run concurrently. errors are collected and thrown after the parallel region.
+    template <typename V = float, typename Rows, typename F>
+    void read_csv_dir_into(const string& path, const int n_shards, Rows& rows, F on_shard) {
+        using T = typename remove_pointer<decltype(rows.row(0))>::type;
+        const size_t n = n_shards < 0 ? count_shards(path) : n_shards;
+        vector<MappedFile> files(n);
+        vector<size_t> shard_rows(n + 1, 0);
+        vector<string> errors(n);
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < n; i++) {
+            try {
+                files[i] = MappedFile(path + '/' + to_string(i) + ".csv");
+                shard_rows[i + 1] = count_lines(files[i].data(), files[i].size());
+            } catch (const exception& e) {
+                errors[i] = path + '/' + to_string(i) + ".csv: " + e.what();
+            }
+        }
+        for (const auto& error : errors) if (!error.empty()) throw runtime_error(error);
+        partial_sum(shard_rows.begin(), shard_rows.end(), shard_rows.begin());
+
+        size_t dim = 0;
+        for (const auto& file : files) {
+            if (file.size() == 0) continue;
+            const auto* first_end = static_cast<const char*>(memchr(file.data(), '\n', file.size()));
+            dim = count(file.data(), first_end ? first_end : file.data() + file.size(), ',');
+            break;
+        }
+        rows.allocate(shard_rows[n], dim);
+
+        bool consumer_failed = false;
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t i = 0; i < n; i++) {
+            vector<V> scratch(is_same<T, V>::value ? 0 : dim);
+            const char* p = files[i].data();
+            const char* end = p + files[i].size();
+            for (size_t line = shard_rows[i]; p < end; line++) {
+                const auto* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+                const char* line_end = newline ? newline : end;
+
+                const auto parsed = from_chars(p, line_end, rows.ids[line]);
+                bool valid = parsed.ec == errc() && parsed.ptr != line_end && *parsed.ptr == ',';
+                if constexpr (is_same<T, V>::value) {
+                    valid = valid && parse_csv_line(parsed.ptr + 1, line_end, dim, rows.row(line));
+                } else {
+                    valid = valid && parse_csv_line(parsed.ptr + 1, line_end, dim, scratch.data());
+                    if (valid) std::transform(scratch.begin(), scratch.end(), rows.row(line), saturate_cast<T, V>);
+                }
+                if (!valid) {
+                    errors[i] = path + '/' + to_string(i) + ".csv: malformed line " +
+                                to_string(line - shard_rows[i] + 1);
+                    break;
+                }
+                p = newline ? newline + 1 : end;
+            }
+            files[i] = MappedFile();
+
+            // once on_shard has thrown, its consumer is in an unknown state, so it gets no more shards
+            bool skip;
+#pragma omp atomic read
+            skip = consumer_failed;
+            if (errors[i].empty() && !skip) {
+                try {
+                    on_shard(static_cast<const Rows&>(rows), shard_rows[i], shard_rows[i + 1]);
+                } catch (const exception& e) {
+#pragma omp atomic write
+                    consumer_failed = true;
+                    errors[i] = path + '/' + to_string(i) + ".csv: " + e.what();
+                }
+            }
+        }
+        for (const auto& error : errors) if (!error.empty()) throw runtime_error(error);
+    }
+
+    // read_csv_dir_into a matrix of T, with on_shard called one call at a time;
+    // no call follows one that has thrown
+    template <typename T = float, typename F>
+    Matrix<T> read_csv_dir(const string& path, const int n_shards, F on_shard) {
+        Matrix<T> matrix;
+        bool failed = false;
+        read_csv_dir_into<T>(path, n_shards, matrix, [&](const Matrix<T>& rows, size_t begin, size_t end) {
+            exception_ptr error;
+#pragma omp critical(arailib_read_csv_dir)
+            {
+                try {
+                    if (!failed) on_shard(rows, begin, end);
+                } catch (...) {
+                    failed = true;
+                    error = current_exception();
+                }
+            }
+            if (error) rethrow_exception(error);
+        });
+        return matrix;
+    }
+
+    template <typename T = float>
+    Matrix<T> read_csv_dir(const string& path, const int n_shards) {
+        return read_csv_dir<T>(path, n_shards, [](const Matrix<T>&, size_t, size_t) {});
+    }
+
+    // n is the number of rows to read from a vecs or CSV file, or the number of shards
+    // of a directory (see read_csv_dir); n < 0 reads everything
+    template <typename T = float>
+    Series<T> load_data(const string& path, int n = -1) {
+        // TEXMEX vecs file
+        if (is_vecs(path)) return read_vecs<T>(path, n);
+
+        // file path
+        if (path.rfind(".csv", path.size()) < path.size()) {
+            return parse_csv<T>(path, n).to_series();
+        }
+
+        // dir path
+        return read_csv_dir<T>(path, n).to_series();
     }
 
     template<typename T>
@@ -0,0 +1,300 @@
+#ifndef VPTREE_MVPTREE_HPP
+#define VPTREE_MVPTREE_HPP
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <arailib.hpp>
+#include <vptree.hpp>
+
+using namespace std;
+using namespace arailib;
+
+// multi-vantage-point tree (Bozkaya & Ozsoyoglu 1997).
+// every internal node has two vantage points; the first splits its points into m groups by
+// distance, the second splits each group into m again, giving m * m branches. every leaf point
+// keeps its distances to the first n_path vantage points on its path, which filter it by the
+// triangle inequality before its true distance is computed.
+namespace vptree {
+    struct MVPNode {
+        uint64_t row = 0;           // first vantage point (the second is row + 1), or first row of a leaf
+        uint64_t n_rows = 0;        // number of rows in the leaf bucket, 0 for internal nodes
+        uint64_t first_branch = 0;  // internal nodes: branches [first_branch, first_branch + m * m)
+        uint32_t path_length = 0;   // leaves: number of path distances stored per point
+
+        bool is_leaf() const { return n_rows > 0; }
+    };
+
+    // a child of an internal node with the extent of its distances to both vantage points
+    struct MVPBranch {
+        int64_t child = no_node;
+        float d1_min = 0;
+        float d1_max = 0;
+        float d2_min = 0;
+        float d2_max = 0;
+    };
+
+    template <typename Metric = DynamicDistance>
+    struct BasicMVPTree {
+        Arena<> arena;
+        vector<MVPNode> nodes;
+        vector<MVPBranch> branches;
+        vector<float> path_dists;  // n_path distances per row, valid for leaf rows
+        const Metric df;
+        const bool unit_vectors;  // rows and queries are normalized for df
+        unsigned random_state;
+        size_t m;          // groups per vantage point
+        size_t leaf_size;  // subsets of at most this many points become leaf buckets
+        size_t n_path;     // path distances kept per leaf point
+
+        BasicMVPTree(const Metric& df = Metric(),
+                     const unsigned random_state = 42,
+                     const size_t m = 2,
+                     const size_t leaf_size = 16,
+                     const size_t n_path = 4) :
+                     df(df), unit_vectors(is_normalized(df)), random_state(random_state), m(max<size_t>(m, 2)),
+                     leaf_size(max<size_t>(leaf_size, 1)), n_path(n_path) {}
+
+        float distance(size_t row_a, size_t row_b) const {
+            return df(arena.row(row_a), arena.row(row_b), arena.dim);
+        }
+
+        float distance(const Data<>& query, size_t row) const {
+            return df(query.x.data(), arena.row(row), arena.dim);
+        }
+
+        float distance(const Data<>& query, size_t row, float bound) const {
+            return bounded_distance(df, query.x.data(), arena.row(row), arena.dim, bound);
+        }
+
+        const Data<>& prepare_query(const Data<>& query, optional<Data<>>& buffer) const {
+            if (arena.size() > 0 && query.size() != arena.dim) throw runtime_error("query dimension mismatch");
+            if (!unit_vectors) return query;
+            buffer = query;
+            normalize(buffer->x.data(), buffer->size());
+            return *buffer;
+        }
+
+        const float* path_of(size_t row) const { return path_dists.data() + row * n_path; }
+
+        void build(const Series<>& series) {
+            arena.assign(series);
+            build_arena();
+        }
+
+        void build(const Matrix<>& matrix) {
+            arena.assign(matrix);
+            build_arena();
+        }
+
+        void build(const string& data_path, const int n) {
+            if (is_csv(data_path)) build(parse_csv(data_path, n));
+            else if (is_vecs(data_path)) build(load_data(data_path, n));
+            else build(read_csv_dir(data_path, n));
+        }
+
+        // builds the tree over the points already in arena
+        void build_arena() {
+            BasicVPTree<Metric>::check_dim(arena.dim);
+            if (unit_vectors) {
+                for (size_t row = 0; row < arena.size(); row++) normalize(arena.row(row), arena.dim);
+            }
+            nodes.clear();
+            branches.clear();
+            path_dists.assign(arena.size() * n_path, 0);
+
+            vector<BuildItem> items(arena.size());
+            for (size_t i = 0; i < items.size(); i++) items[i].row = i;
+            SplitMix64 engine(random_state);
+            if (!items.empty()) build_level(items, 0, items.size(), 0, engine);
+
+            // lay out points and their path distances in build order
+            Rows order(items.size());
+            for (size_t i = 0; i < items.size(); i++) order[i] = items[i].row;
+            arena.permute(order);
+            vector<float> permuted(path_dists.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                std::copy(path_of(order[i]), path_of(order[i]) + n_path, permuted.begin() + i * n_path);
+            }
+            path_dists = move(permuted);
+        }
+
+        // splits items [begin, end) into m groups of near-equal size by dist;
+        // bounds receives the m + 1 group boundaries
+        void split(vector<BuildItem>& items, size_t begin, size_t end, vector<size_t>& bounds) const {
+            sort(items.begin() + begin, items.begin() + end,
+                 [](const BuildItem& a, const BuildItem& b) { return a.dist < b.dist; });
+            bounds.resize(m + 1);
+            for (size_t g = 0; g <= m; g++) bounds[g] = begin + (end - begin) * g / m;
+        }
+
+        // builds the subtree over items [begin, end) whose points have passed path_length
+        // vantage points, and returns its node index
+        int64_t build_level(vector<BuildItem>& items, size_t begin, size_t end,
+                            size_t path_length, SplitMix64& engine) {
+            if (end <= begin) return no_node;
+
+            const int64_t index = nodes.size();
+            nodes.emplace_back();
+            nodes[index].row = begin;
+
+            if (end - begin <= leaf_size) {
+                nodes[index].n_rows = end - begin;
+                nodes[index].path_length = min(path_length, n_path);
+                return index;
+            }
+
+            // first vantage point at random, second as the point farthest from it
+            swap(items[begin], items[begin + engine.uniform(end - begin)]);
+            const auto vp1 = items[begin].row;
+            for (size_t i = begin + 1; i < end; i++) items[i].dist = distance(vp1, items[i].row);
+            const auto farthest = max_element(items.begin() + begin + 1, items.begin() + end,
+                [](const BuildItem& a, const BuildItem& b) { return a.dist < b.dist; });
+            swap(items[begin + 1], *farthest);
+            const auto vp2 = items[begin + 1].row;
+
+            const auto first_branch = branches.size();
+            nodes[index].first_branch = first_branch;
+            branches.resize(first_branch + m * m);
+
+            const auto rest = begin + 2;
+            for (size_t i = rest; i < end; i++) {
+                if (path_length < n_path) path_dists[items[i].row * n_path + path_length] = items[i].dist;
+            }
+
+            // partition by the first vantage point
+            vector<size_t> outer_bounds;
+            split(items, rest, end, outer_bounds);
+            vector<float> first_dists(end - rest);
+            for (size_t i = rest; i < end; i++) first_dists[i - rest] = items[i].dist;
+
+            // and every group by the second
+            for (size_t i = rest; i < end; i++) {
+                items[i].dist = distance(vp2, items[i].row);
+                if (path_length + 1 < n_path) path_dists[items[i].row * n_path + path_length + 1] = items[i].dist;
+            }
+
+            vector<pair<size_t, size_t>> ranges;
+            for (size_t g = 0; g < m; g++) {
+                // keep the first distance of every item next to it while sorting by the second
+                vector<pair<BuildItem, float>> group;
+                for (size_t i = outer_bounds[g]; i < outer_bounds[g + 1]; i++) {
+                    group.emplace_back(items[i], first_dists[i - rest]);
+                }
+                sort(group.begin(), group.end(), [](const pair<BuildItem, float>& a, const pair<BuildItem, float>& b) {
+                    return a.first.dist < b.first.dist;
+                });
+
+                const auto group_begin = outer_bounds[g];
+                const auto group_size = group.size();
+                for (size_t h = 0; h < m; h++) {
+                    const auto lo = group_size * h / m, hi = group_size * (h + 1) / m;
+                    auto& branch = branches[first_branch + g * m + h];
+                    branch.d1_min = branch.d2_min = numeric_limits<float>::infinity();
+                    branch.d1_max = branch.d2_max = -numeric_limits<float>::infinity();
+                    for (size_t i = lo; i < hi; i++) {
+                        items[group_begin + i] = group[i].first;
+                        branch.d1_min = min(branch.d1_min, group[i].second);
+                        branch.d1_max = max(branch.d1_max, group[i].second);
+                        branch.d2_min = min(branch.d2_min, group[i].first.dist);
+                        branch.d2_max = max(branch.d2_max, group[i].first.dist);
+                    }
+                    ranges.emplace_back(group_begin + lo, group_begin + hi);
+                }
+            }
+
+            for (size_t b = 0; b < m * m; b++) {
+                const auto child = build_level(items, ranges[b].first, ranges[b].second, path_length + 2, engine);
+                branches[first_branch + b].child = child;
+            }
+            return index;
+        }
+
+        SearchResult range_search(const Data<>& query, const float range) const {
+            const auto start = get_now();
+            auto result = SearchResult();
+            range_search(query, range, result.series);
+            const auto end = get_now();
+            result.time = get_duration(start, end);
+            return result;
+        }
+
+        // appends (id, distance) of every point closer than range to result
+        void range_search(const Data<>& raw_query, const float range, vector<Neighbor>& result) const {
+            if (nodes.empty()) return;
+            optional<Data<>> buffer;
+            const auto& query = prepare_query(raw_query, buffer);
+            vector<float> query_path;
+            search_level(query, 0, query_path, [&]() { return range; },
+                         [&](size_t row, float dist) {
+                             if (dist < range) result.push_back({arena.id(row), dist});
+                         });
+        }
+
+        SearchResult knn_search(const Data<>& raw_query, int k) const {
+            const auto start = get_now();
+            auto result = SearchResult();
+
+            if (k > 0 && !nodes.empty()) {
+                optional<Data<>> buffer;
+                const auto& query = prepare_query(raw_query, buffer);
+                KnnCollector collector(k, arena.size());
+                vector<float> query_path;
+                search_level(query, 0, query_path, [&]() { return collector.bound(); },
+                             [&](size_t row, float dist) { collector.push(arena.id(row), dist); });
+                result.series = collector.sorted();
+            }
+
+            const auto end = get_now();
+            result.time = get_duration(start, end);
+            return result;
+        }
+
+        // visits every point that may lie within bound() of query and hands it to report.
+        // query_path holds the distances from query to the vantage points on the path.
+        template <typename Bound, typename Report>
+        void search_level(const Data<>& query, int64_t index, vector<float>& query_path,
+                          Bound bound, Report report) const {
+            const auto& node = nodes[index];
+
+            if (node.is_leaf()) {
+                for (size_t row = node.row; row < node.row + node.n_rows; row++) {
+                    const auto* path = path_of(row);
+                    bool filtered = false;
+                    for (size_t j = 0; j < node.path_length; j++) {
+                        if (abs(query_path[j] - path[j]) > bound()) {
+                            filtered = true;
+                            break;
+                        }
+                    }
+                    if (!filtered) report(row, distance(query, row, bound()));
+                }
+                return;
+            }
+
+            const auto d1 = distance(query, node.row);
+            report(node.row, d1);
+            const auto d2 = distance(query, node.row + 1);
+            report(node.row + 1, d2);
+
+            const auto path_size = query_path.size();
+            query_path.push_back(d1);
+            query_path.push_back(d2);
+            for (size_t b = 0; b < m * m; b++) {
+                const auto& branch = branches[node.first_branch + b];
+                if (branch.child == no_node) continue;
+                const auto r = bound();
+                if (d1 + r < branch.d1_min || d1 - r > branch.d1_max ||
+                    d2 + r < branch.d2_min || d2 - r > branch.d2_max) continue;
+                search_level(query, branch.child, query_path, bound, report);
+            }
+            query_path.resize(path_size);
+        }
+    };
+
+    // distance selected at runtime by name ("euclidean", "manhattan", "angular")
+    using MVPTree = BasicMVPTree<>;
+}
+
+#endif //VPTREE_MVPTREE_HPP
@@ -0,0 +1,846 @@
+#ifndef ARAILIB_SIMD_HPP
+#define ARAILIB_SIMD_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ARAILIB_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// distance kernels on raw float spans.
+// the widest instruction set supported by the running CPU is selected once,
+// on first use; set ARAILIB_SIMD=scalar|sse|avx2|avx512 to force a narrower one.
+namespace arailib {
+    // IEEE 754 half-precision value for compact storage; arithmetic goes through float
+    struct half {
+        uint16_t bits = 0;
+
+        half() = default;
+        half(float value) : bits(from_float(value)) {}
+        operator float() const { return to_float(bits); }
+
+        static float to_float(uint16_t h) {
+            const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+            const uint32_t exponent = (h >> 10) & 0x1f;
+            const uint32_t mantissa = h & 0x3ff;
+            if (exponent == 0) {
+                const float value = std::ldexp(static_cast<float>(mantissa), -24);
+                return sign ? -value : value;
+            }
+            uint32_t bits = sign | (mantissa << 13);
+            bits |= exponent == 0x1f ? 0x7f800000 : (exponent + 112) << 23;
+            float result;
+            std::memcpy(&result, &bits, sizeof(result));
+            return result;
+        }
+
+        // rounds to nearest, ties to even
+        static uint16_t from_float(float value) {
+            uint32_t x;
+            std::memcpy(&x, &value, sizeof(x));
+            const auto sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+            const int32_t exponent = static_cast<int32_t>((x >> 23) & 0xff) - 127 + 15;
+            uint32_t mantissa = x & 0x7fffff;
+            if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+            if (exponent >= 31) return sign | 0x7c00;
+
+            uint32_t shift = 13;
+            uint32_t h;
+            if (exponent <= 0) {
+                // subnormal, or zero below half of the smallest subnormal
+                if (exponent < -10) return sign;
+                mantissa |= 0x800000;
+                shift = 14 - exponent;
+                h = mantissa >> shift;
+            } else {
+                h = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> shift);
+            }
+            const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (h & 1))) h++;  // a carry moves into the exponent
+            return static_cast<uint16_t>(sign | h);
+        }
+    };
+
+    namespace simd {
+        using Kernel = float (*)(const float*, const float*, size_t);
+
+        enum class Isa { scalar, sse, avx2, avx512 };
+
+        struct Kernels {
+            Isa isa;
+            const char* name;
+            Kernel l2_sqr;  // sum of squared differences
+            Kernel l1;      // sum of absolute differences
+            Kernel dot;     // inner product
+            Kernel cosine;  // cosine similarity (not clipped)
+        };
+
+        namespace scalar {
+            inline float l2_sqr(const float* a, const float* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) {
+                    const float d = a[i] - b[i];
+                    result += d * d;
+                }
+                return result;
+            }
+
+            inline float l1(const float* a, const float* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) result += std::abs(a[i] - b[i]);
+                return result;
+            }
+
+            inline float dot(const float* a, const float* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) result += a[i] * b[i];
+                return result;
+            }
+
+            inline float cosine(const float* a, const float* b, size_t n) {
+                float ab = 0, aa = 0, bb = 0;
+                for (size_t i = 0; i < n; i++) {
+                    ab += a[i] * b[i];
+                    aa += a[i] * a[i];
+                    bb += b[i] * b[i];
+                }
+                return ab / std::sqrt(aa * bb);
+            }
+
+            // the kernels above with the dimension fixed at compile time, so that their loops
+            // have constant trip counts and unroll
+            template <size_t Dim>
+            __attribute__((flatten))
+            inline float l2_sqr_fixed(const float* a, const float* b, size_t) { return l2_sqr(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((flatten))
+            inline float l1_fixed(const float* a, const float* b, size_t) { return l1(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((flatten))
+            inline float dot_fixed(const float* a, const float* b, size_t) { return dot(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((flatten))
+            inline float cosine_fixed(const float* a, const float* b, size_t) { return cosine(a, b, Dim); }
+        }
+
+#ifdef ARAILIB_SIMD_X86
+        namespace sse {
+            __attribute__((target("sse3")))
+            inline float hsum(__m128 v) {
+                __m128 shuf = _mm_movehdup_ps(v);
+                __m128 sums = _mm_add_ps(v, shuf);
+                shuf = _mm_movehl_ps(shuf, sums);
+                sums = _mm_add_ss(sums, shuf);
+                return _mm_cvtss_f32(sums);
+            }
+
+            __attribute__((target("sse3")))
+            inline float l2_sqr(const float* a, const float* b, size_t n) {
+                __m128 sum = _mm_setzero_ps();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+                }
+                return hsum(sum) + scalar::l2_sqr(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("sse3")))
+            inline float l1(const float* a, const float* b, size_t n) {
+                const __m128 sign = _mm_set1_ps(-0.0f);
+                __m128 sum = _mm_setzero_ps();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                    sum = _mm_add_ps(sum, _mm_andnot_ps(sign, d));
+                }
+                return hsum(sum) + scalar::l1(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("sse3")))
+            inline float dot(const float* a, const float* b, size_t n) {
+                __m128 sum = _mm_setzero_ps();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                }
+                return hsum(sum) + scalar::dot(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("sse3")))
+            inline float cosine(const float* a, const float* b, size_t n) {
+                __m128 ab = _mm_setzero_ps(), aa = _mm_setzero_ps(), bb = _mm_setzero_ps();
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m128 va = _mm_loadu_ps(a + i), vb = _mm_loadu_ps(b + i);
+                    ab = _mm_add_ps(ab, _mm_mul_ps(va, vb));
+                    aa = _mm_add_ps(aa, _mm_mul_ps(va, va));
+                    bb = _mm_add_ps(bb, _mm_mul_ps(vb, vb));
+                }
+                const float sab = hsum(ab) + scalar::dot(a + i, b + i, n - i);
+                const float saa = hsum(aa) + scalar::dot(a + i, a + i, n - i);
+                const float sbb = hsum(bb) + scalar::dot(b + i, b + i, n - i);
+                return sab / std::sqrt(saa * sbb);
+            }
+
+            // fixed-dimension variants, as in scalar
+            template <size_t Dim>
+            __attribute__((target("sse3"), flatten))
+            inline float l2_sqr_fixed(const float* a, const float* b, size_t) { return l2_sqr(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("sse3"), flatten))
+            inline float l1_fixed(const float* a, const float* b, size_t) { return l1(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("sse3"), flatten))
+            inline float dot_fixed(const float* a, const float* b, size_t) { return dot(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("sse3"), flatten))
+            inline float cosine_fixed(const float* a, const float* b, size_t) { return cosine(a, b, Dim); }
+        }
+
+        namespace avx2 {
+            __attribute__((target("avx2,fma")))
+            inline float hsum(__m256 v) {
+                const __m128 lo = _mm256_castps256_ps128(v);
+                const __m128 hi = _mm256_extractf128_ps(v, 1);
+                return sse::hsum(_mm_add_ps(lo, hi));
+            }
+
+            __attribute__((target("avx2,fma")))
+            inline float l2_sqr(const float* a, const float* b, size_t n) {
+                __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+                    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+                    sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+                }
+                for (; i + 8 <= n; i += 8) {
+                    const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    sum0 = _mm256_fmadd_ps(d, d, sum0);
+                }
+                return hsum(_mm256_add_ps(sum0, sum1)) + scalar::l2_sqr(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("avx2,fma")))
+            inline float l1(const float* a, const float* b, size_t n) {
+                const __m256 sign = _mm256_set1_ps(-0.0f);
+                __m256 sum = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    sum = _mm256_add_ps(sum, _mm256_andnot_ps(sign, d));
+                }
+                return hsum(sum) + scalar::l1(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("avx2,fma")))
+            inline float dot(const float* a, const float* b, size_t n) {
+                __m256 sum = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+                }
+                return hsum(sum) + scalar::dot(a + i, b + i, n - i);
+            }
+
+            __attribute__((target("avx2,fma")))
+            inline float cosine(const float* a, const float* b, size_t n) {
+                __m256 ab = _mm256_setzero_ps(), aa = _mm256_setzero_ps(), bb = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    const __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+                    ab = _mm256_fmadd_ps(va, vb, ab);
+                    aa = _mm256_fmadd_ps(va, va, aa);
+                    bb = _mm256_fmadd_ps(vb, vb, bb);
+                }
+                const float sab = hsum(ab) + scalar::dot(a + i, b + i, n - i);
+                const float saa = hsum(aa) + scalar::dot(a + i, a + i, n - i);
+                const float sbb = hsum(bb) + scalar::dot(b + i, b + i, n - i);
+                return sab / std::sqrt(saa * sbb);
+            }
+
+            // fixed-dimension variants, as in scalar
+            template <size_t Dim>
+            __attribute__((target("avx2,fma"), flatten))
+            inline float l2_sqr_fixed(const float* a, const float* b, size_t) { return l2_sqr(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx2,fma"), flatten))
+            inline float l1_fixed(const float* a, const float* b, size_t) { return l1(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx2,fma"), flatten))
+            inline float dot_fixed(const float* a, const float* b, size_t) { return dot(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx2,fma"), flatten))
+            inline float cosine_fixed(const float* a, const float* b, size_t) { return cosine(a, b, Dim); }
+        }
+
+        namespace avx512 {
+            // remaining lanes are loaded with a mask, so there is no scalar tail
+            __attribute__((target("avx512f")))
+            inline __mmask16 tail_mask(size_t rest) {
+                return static_cast<__mmask16>((1u << rest) - 1);
+            }
+
+            __attribute__((target("avx512f")))
+            inline float l2_sqr(const float* a, const float* b, size_t n) {
+                __m512 sum = _mm512_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                    sum = _mm512_fmadd_ps(d, d, sum);
+                }
+                if (i < n) {
+                    const __mmask16 m = tail_mask(n - i);
+                    const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i),
+                                                   _mm512_maskz_loadu_ps(m, b + i));
+                    sum = _mm512_fmadd_ps(d, d, sum);
+                }
+                return _mm512_reduce_add_ps(sum);
+            }
+
+            __attribute__((target("avx512f")))
+            inline float l1(const float* a, const float* b, size_t n) {
+                __m512 sum = _mm512_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                    sum = _mm512_add_ps(sum, _mm512_abs_ps(d));
+                }
+                if (i < n) {
+                    const __mmask16 m = tail_mask(n - i);
+                    const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i),
+                                                   _mm512_maskz_loadu_ps(m, b + i));
+                    sum = _mm512_add_ps(sum, _mm512_abs_ps(d));
+                }
+                return _mm512_reduce_add_ps(sum);
+            }
+
+            __attribute__((target("avx512f")))
+            inline float dot(const float* a, const float* b, size_t n) {
+                __m512 sum = _mm512_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+                }
+                if (i < n) {
+                    const __mmask16 m = tail_mask(n - i);
+                    sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i),
+                                          _mm512_maskz_loadu_ps(m, b + i), sum);
+                }
+                return _mm512_reduce_add_ps(sum);
+            }
+
+            __attribute__((target("avx512f")))
+            inline float cosine(const float* a, const float* b, size_t n) {
+                __m512 ab = _mm512_setzero_ps(), aa = _mm512_setzero_ps(), bb = _mm512_setzero_ps();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m512 va = _mm512_loadu_ps(a + i), vb = _mm512_loadu_ps(b + i);
+                    ab = _mm512_fmadd_ps(va, vb, ab);
+                    aa = _mm512_fmadd_ps(va, va, aa);
+                    bb = _mm512_fmadd_ps(vb, vb, bb);
+                }
+                if (i < n) {
+                    const __mmask16 m = tail_mask(n - i);
+                    const __m512 va = _mm512_maskz_loadu_ps(m, a + i);
+                    const __m512 vb = _mm512_maskz_loadu_ps(m, b + i);
+                    ab = _mm512_fmadd_ps(va, vb, ab);
+                    aa = _mm512_fmadd_ps(va, va, aa);
+                    bb = _mm512_fmadd_ps(vb, vb, bb);
+                }
+                return _mm512_reduce_add_ps(ab) /
+                       std::sqrt(_mm512_reduce_add_ps(aa) * _mm512_reduce_add_ps(bb));
+            }
+
+            // fixed-dimension variants, as in scalar
+            template <size_t Dim>
+            __attribute__((target("avx512f"), flatten))
+            inline float l2_sqr_fixed(const float* a, const float* b, size_t) { return l2_sqr(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx512f"), flatten))
+            inline float l1_fixed(const float* a, const float* b, size_t) { return l1(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx512f"), flatten))
+            inline float dot_fixed(const float* a, const float* b, size_t) { return dot(a, b, Dim); }
+
+            template <size_t Dim>
+            __attribute__((target("avx512f"), flatten))
+            inline float cosine_fixed(const float* a, const float* b, size_t) { return cosine(a, b, Dim); }
+        }
+#endif
+
+        inline bool is_supported(Isa isa) {
+#ifdef ARAILIB_SIMD_X86
+            __builtin_cpu_init();
+            switch (isa) {
+                case Isa::scalar: return true;
+                case Isa::sse:    return __builtin_cpu_supports("sse3");
+                case Isa::avx2:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+                case Isa::avx512: return __builtin_cpu_supports("avx512f");
+            }
+            return false;
+#else
+            return isa == Isa::scalar;
+#endif
+        }
+
+        // kernels of isa; with Dim > 0, they are specialized for (and only accept) vectors of Dim floats
+        template <size_t Dim = 0>
+        inline Kernels kernels_for(Isa isa) {
+#ifdef ARAILIB_SIMD_X86
+            switch (isa) {
+                case Isa::avx512:
+                    if constexpr (Dim > 0) {
+                        return {isa, "avx512", avx512::l2_sqr_fixed<Dim>, avx512::l1_fixed<Dim>,
+                                avx512::dot_fixed<Dim>, avx512::cosine_fixed<Dim>};
+                    }
+                    return {isa, "avx512", avx512::l2_sqr, avx512::l1, avx512::dot, avx512::cosine};
+                case Isa::avx2:
+                    if constexpr (Dim > 0) {
+                        return {isa, "avx2", avx2::l2_sqr_fixed<Dim>, avx2::l1_fixed<Dim>,
+                                avx2::dot_fixed<Dim>, avx2::cosine_fixed<Dim>};
+                    }
+                    return {isa, "avx2", avx2::l2_sqr, avx2::l1, avx2::dot, avx2::cosine};
+                case Isa::sse:
+                    if constexpr (Dim > 0) {
+                        return {isa, "sse", sse::l2_sqr_fixed<Dim>, sse::l1_fixed<Dim>,
+                                sse::dot_fixed<Dim>, sse::cosine_fixed<Dim>};
+                    }
+                    return {isa, "sse", sse::l2_sqr, sse::l1, sse::dot, sse::cosine};
+                case Isa::scalar:
+                    break;
+            }
+#endif
+            if constexpr (Dim > 0) {
+                return {Isa::scalar, "scalar", scalar::l2_sqr_fixed<Dim>, scalar::l1_fixed<Dim>,
+                        scalar::dot_fixed<Dim>, scalar::cosine_fixed<Dim>};
+            }
+            return {Isa::scalar, "scalar", scalar::l2_sqr, scalar::l1, scalar::dot, scalar::cosine};
+        }
+
+        // widest instruction set allowed by ARAILIB_SIMD
+        inline Isa isa_limit() {
+            if (const char* env = std::getenv("ARAILIB_SIMD")) {
+                if (std::strcmp(env, "scalar") == 0) return Isa::scalar;
+                if (std::strcmp(env, "sse") == 0) return Isa::sse;
+                if (std::strcmp(env, "avx2") == 0) return Isa::avx2;
+            }
+            return Isa::avx512;
+        }
+
+        template <size_t Dim = 0>
+        inline Kernels detect_kernels() {
+            const Isa limit = isa_limit();
+            for (auto isa : {Isa::avx512, Isa::avx2, Isa::sse}) {
+                if (isa <= limit && is_supported(isa)) return kernels_for<Dim>(isa);
+            }
+            return kernels_for<Dim>(Isa::scalar);
+        }
+
+        // kernels of the selected instruction set, for any dimension (Dim = 0) or for Dim only
+        template <size_t Dim = 0>
+        inline const Kernels& active() {
+            static const Kernels kernels = detect_kernels<Dim>();
+            return kernels;
+        }
+
+        inline float l2_sqr(const float* a, const float* b, size_t n) { return active().l2_sqr(a, b, n); }
+        inline float l1(const float* a, const float* b, size_t n) { return active().l1(a, b, n); }
+        inline float dot(const float* a, const float* b, size_t n) { return active().dot(a, b, n); }
+        inline float cosine(const float* a, const float* b, size_t n) { return active().cosine(a, b, n); }
+
+        constexpr size_t abandon_block = 64;  // dimensions summed between bound checks
+
+        // sum of kernel over blocks of abandon_block dimensions, abandoned as soon as the partial
+        // sum exceeds bound. the result is the full sum if it is at most bound, otherwise > bound.
+        template <typename T>
+        float bounded(float (*kernel)(const T*, const T*, size_t), const T* a, const T* b, size_t n, float bound) {
+            float result = 0;
+            for (size_t i = 0; i < n; i += abandon_block) {
+                result += kernel(a + i, b + i, std::min(abandon_block, n - i));
+                if (result > bound) break;
+            }
+            return result;
+        }
+
+        inline float l2_sqr_bounded(const float* a, const float* b, size_t n, float bound) {
+            return bounded(active().l2_sqr, a, b, n, bound);
+        }
+
+        inline float l1_bounded(const float* a, const float* b, size_t n, float bound) {
+            return bounded(active().l1, a, b, n, bound);
+        }
+
+        // bounded over vectors of Dim floats, with the full blocks and the tail summed by
+        // kernels specialized for their size
+        template <size_t Dim>
+        float bounded_fixed(Kernel Kernels::* kernel, const float* a, const float* b, float bound) {
+            float result = 0;
+            size_t i = 0;
+            for (; i + abandon_block <= Dim; i += abandon_block) {
+                result += (active<abandon_block>().*kernel)(a + i, b + i, abandon_block);
+                if (result > bound) return result;
+            }
+            if constexpr (Dim % abandon_block > 0) {
+                result += (active<Dim % abandon_block>().*kernel)(a + i, b + i, Dim % abandon_block);
+            }
+            return result;
+        }
+
+        // bounded over one pair of vectors, of Dim floats if Dim > 0
+        template <size_t Dim>
+        float bounded_row(Kernel Kernels::* kernel, const float* a, const float* b, size_t n, float bound) {
+            if constexpr (Dim > 0) return bounded_fixed<Dim>(kernel, a, b, bound);
+            else return bounded(active().*kernel, a, b, n, bound);
+        }
+
+        // one-to-many kernels for leaf scans: out[r] is the sum of kernel over the query and the vector
+        // at rows + r * stride, for r < n_rows, abandoned like bounded once it exceeds bound.
+        // with Dim > 0 the vectors have Dim floats and n is ignored.
+        using RowsKernel = void (*)(const float*, const float*, size_t, size_t, size_t, float, float*);
+
+        struct RowsKernels {
+            Isa isa;
+            const char* name;
+            RowsKernel l2_sqr;
+            RowsKernel l1;
+        };
+
+        // one row at a time, for instruction sets without a one-to-many kernel
+        template <size_t Dim, Kernel Kernels::* kernel>
+        void each_row(const float* query, const float* rows, size_t stride, size_t n_rows, size_t n,
+                      float bound, float* out) {
+            for (size_t r = 0; r < n_rows; r++) out[r] = bounded_row<Dim>(kernel, query, rows + r * stride, n, bound);
+        }
+
+#ifdef ARAILIB_SIMD_X86
+        // groups of row_group rows are measured together, so that each block of the query is loaded
+        // once per group; a group is abandoned once all of its rows exceed the bound
+        constexpr size_t row_group = 4;
+
+        namespace avx2 {
+            template <bool Abs>
+            __attribute__((target("avx2,fma")))
+            inline __m256 accumulate(__m256 sum, __m256 a, __m256 b) {
+                const __m256 d = _mm256_sub_ps(a, b);
+                return Abs ? _mm256_add_ps(sum, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), d)) : _mm256_fmadd_ps(d, d, sum);
+            }
+
+            template <bool Abs, size_t Dim, Kernel Kernels::* kernel>
+            __attribute__((target("avx2,fma")))
+            void rows(const float* query, const float* rows, size_t stride, size_t n_rows, size_t n,
+                      float bound, float* out) {
+                if constexpr (Dim > 0) n = Dim;
+                size_t r = 0;
+                for (; r + row_group <= n_rows; r += row_group) {
+                    const float* p[row_group];
+                    float sums[row_group] = {};
+                    for (size_t k = 0; k < row_group; k++) p[k] = rows + (r + k) * stride;
+                    for (size_t begin = 0; begin < n; begin += abandon_block) {
+                        const auto end = std::min(begin + abandon_block, n);
+                        __m256 acc[row_group];
+                        for (size_t k = 0; k < row_group; k++) acc[k] = _mm256_setzero_ps();
+                        size_t i = begin;
+                        for (; i + 8 <= end; i += 8) {
+                            const __m256 q = _mm256_loadu_ps(query + i);
+                            for (size_t k = 0; k < row_group; k++) {
+                                acc[k] = accumulate<Abs>(acc[k], q, _mm256_loadu_ps(p[k] + i));
+                            }
+                        }
+                        for (size_t k = 0; k < row_group; k++) {
+                            sums[k] += hsum(acc[k]) + (Abs ? scalar::l1(query + i, p[k] + i, end - i)
+                                                           : scalar::l2_sqr(query + i, p[k] + i, end - i));
+                        }
+                        if (*std::min_element(sums, sums + row_group) > bound) break;
+                    }
+                    std::copy(sums, sums + row_group, out + r);
+                }
+                for (; r < n_rows; r++) out[r] = bounded_row<Dim>(kernel, query, rows + r * stride, n, bound);
+            }
+        }
+
+        namespace avx512 {
+            template <bool Abs>
+            __attribute__((target("avx512f")))
+            inline __m512 accumulate(__m512 sum, __m512 a, __m512 b) {
+                const __m512 d = _mm512_sub_ps(a, b);
+                return Abs ? _mm512_add_ps(sum, _mm512_abs_ps(d)) : _mm512_fmadd_ps(d, d, sum);
+            }
+
+            template <bool Abs, size_t Dim, Kernel Kernels::* kernel>
+            __attribute__((target("avx512f")))
+            void rows(const float* query, const float* rows, size_t stride, size_t n_rows, size_t n,
+                      float bound, float* out) {
+                if constexpr (Dim > 0) n = Dim;
+                size_t r = 0;
+                for (; r + row_group <= n_rows; r += row_group) {
+                    const float* p[row_group];
+                    float sums[row_group] = {};
+                    for (size_t k = 0; k < row_group; k++) p[k] = rows + (r + k) * stride;
+                    for (size_t begin = 0; begin < n; begin += abandon_block) {
+                        const auto end = std::min(begin + abandon_block, n);
+                        __m512 acc[row_group];
+                        for (size_t k = 0; k < row_group; k++) acc[k] = _mm512_setzero_ps();
+                        size_t i = begin;
+                        for (; i + 16 <= end; i += 16) {
+                            const __m512 q = _mm512_loadu_ps(query + i);
+                            for (size_t k = 0; k < row_group; k++) {
+                                acc[k] = accumulate<Abs>(acc[k], q, _mm512_loadu_ps(p[k] + i));
+                            }
+                        }
+                        if (i < end) {
+                            const __mmask16 m = tail_mask(end - i);
+                            const __m512 q = _mm512_maskz_loadu_ps(m, query + i);
+                            for (size_t k = 0; k < row_group; k++) {
+                                acc[k] = accumulate<Abs>(acc[k], q, _mm512_maskz_loadu_ps(m, p[k] + i));
+                            }
+                        }
+                        for (size_t k = 0; k < row_group; k++) sums[k] += _mm512_reduce_add_ps(acc[k]);
+                        if (*std::min_element(sums, sums + row_group) > bound) break;
+                    }
+                    std::copy(sums, sums + row_group, out + r);
+                }
+                for (; r < n_rows; r++) out[r] = bounded_row<Dim>(kernel, query, rows + r * stride, n, bound);
+            }
+        }
+#endif
+
+        template <size_t Dim = 0>
+        inline RowsKernels rows_kernels_for(Isa isa) {
+#ifdef ARAILIB_SIMD_X86
+            switch (isa) {
+                case Isa::avx512:
+                    return {isa, "avx512", avx512::rows<false, Dim, &Kernels::l2_sqr>,
+                            avx512::rows<true, Dim, &Kernels::l1>};
+                case Isa::avx2:
+                    return {isa, "avx2", avx2::rows<false, Dim, &Kernels::l2_sqr>, avx2::rows<true, Dim, &Kernels::l1>};
+                default:
+                    break;
+            }
+#endif
+            return {isa, "each_row", each_row<Dim, &Kernels::l2_sqr>, each_row<Dim, &Kernels::l1>};
+        }
+
+        // one-to-many kernels of the instruction set active<Dim>() selected
+        template <size_t Dim = 0>
+        inline const RowsKernels& rows_active() {
+            static const RowsKernels kernels = rows_kernels_for<Dim>(active<Dim>().isa);
+            return kernels;
+        }
+
+        // kernels for narrow element types (uint8_t, int16_t, half). values are widened to float,
+        // or uint8_t differences to 16-bit integers, and accumulated in 32 bits.
+        template <typename T>
+        constexpr bool is_widened = std::is_same<T, uint8_t>::value || std::is_same<T, int16_t>::value ||
+                                    std::is_same<T, half>::value;
+
+        template <typename T>
+        struct WidenedKernels {
+            using Kernel = float (*)(const T*, const T*, size_t);
+
+            Isa isa;
+            const char* name;
+            Kernel l2_sqr;
+            Kernel l1;
+            Kernel dot;
+        };
+
+        namespace scalar {
+            template <typename T>
+            float l2_sqr(const T* a, const T* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) {
+                    const float d = static_cast<float>(a[i]) - static_cast<float>(b[i]);
+                    result += d * d;
+                }
+                return result;
+            }
+
+            template <typename T>
+            float l1(const T* a, const T* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) {
+                    result += std::abs(static_cast<float>(a[i]) - static_cast<float>(b[i]));
+                }
+                return result;
+            }
+
+            template <typename T>
+            float dot(const T* a, const T* b, size_t n) {
+                float result = 0;
+                for (size_t i = 0; i < n; i++) result += static_cast<float>(a[i]) * static_cast<float>(b[i]);
+                return result;
+            }
+        }
+
+#ifdef ARAILIB_SIMD_X86
+        namespace avx2 {
+            // eight values widened to float
+            __attribute__((target("avx2,fma")))
+            inline __m256 widen(const uint8_t* p) {
+                return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+            }
+
+            __attribute__((target("avx2,fma")))
+            inline __m256 widen(const int16_t* p) {
+                return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+            }
+
+            __attribute__((target("avx2,fma,f16c")))
+            inline __m256 widen(const half* p) {
+                return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+            }
+
+            template <typename T>
+            __attribute__((target("avx2,fma,f16c")))
+            inline float l2_sqr(const T* a, const T* b, size_t n) {
+                __m256 sum = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    const __m256 d = _mm256_sub_ps(widen(a + i), widen(b + i));
+                    sum = _mm256_fmadd_ps(d, d, sum);
+                }
+                return hsum(sum) + scalar::l2_sqr(a + i, b + i, n - i);
+            }
+
+            template <typename T>
+            __attribute__((target("avx2,fma,f16c")))
+            inline float l1(const T* a, const T* b, size_t n) {
+                const __m256 sign = _mm256_set1_ps(-0.0f);
+                __m256 sum = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    sum = _mm256_add_ps(sum, _mm256_andnot_ps(sign, _mm256_sub_ps(widen(a + i), widen(b + i))));
+                }
+                return hsum(sum) + scalar::l1(a + i, b + i, n - i);
+            }
+
+            template <typename T>
+            __attribute__((target("avx2,fma,f16c")))
+            inline float dot(const T* a, const T* b, size_t n) {
+                __m256 sum = _mm256_setzero_ps();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) sum = _mm256_fmadd_ps(widen(a + i), widen(b + i), sum);
+                return hsum(sum) + scalar::dot(a + i, b + i, n - i);
+            }
+
+            // uint8_t differences fit in 16 bits, so 16 of them are squared and pairwise summed per madd
+            __attribute__((target("avx2,fma")))
+            inline float l2_sqr(const uint8_t* a, const uint8_t* b, size_t n) {
+                __m256i sum = _mm256_setzero_si256();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+                    const __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+                    const __m256i d = _mm256_sub_epi16(va, vb);
+                    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+                }
+                return hsum(_mm256_cvtepi32_ps(sum)) + scalar::l2_sqr(a + i, b + i, n - i);
+            }
+
+            // sums of absolute uint8_t differences, 32 at a time into four 64-bit lanes
+            __attribute__((target("avx2,fma")))
+            inline float l1(const uint8_t* a, const uint8_t* b, size_t n) {
+                __m256i sum = _mm256_setzero_si256();
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))));
+                }
+                uint64_t lanes[4];
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sum);
+                return static_cast<float>(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + scalar::l1(a + i, b + i, n - i);
+            }
+        }
+#endif
+
+        // the AVX2 kernels, which also serve AVX-512 CPUs, need F16C for half
+        template <typename T>
+        WidenedKernels<T> widened_kernels_for(Isa isa) {
+            using Kernel = typename WidenedKernels<T>::Kernel;
+#ifdef ARAILIB_SIMD_X86
+            if (isa >= Isa::avx2) {
+                const Kernel l2_sqr = avx2::l2_sqr, l1 = avx2::l1, dot = avx2::dot;
+                return {Isa::avx2, "avx2", l2_sqr, l1, dot};
+            }
+#endif
+            const Kernel l2_sqr = scalar::l2_sqr, l1 = scalar::l1, dot = scalar::dot;
+            return {Isa::scalar, "scalar", l2_sqr, l1, dot};
+        }
+
+        inline bool has_widening_isa() {
+#ifdef ARAILIB_SIMD_X86
+            __builtin_cpu_init();
+            return isa_limit() >= Isa::avx2 && is_supported(Isa::avx2) && __builtin_cpu_supports("f16c");
+#else
+            return false;
+#endif
+        }
+
+        template <typename T>
+        const WidenedKernels<T>& widened_active() {
+            static const WidenedKernels<T> kernels = widened_kernels_for<T>(has_widening_isa() ? Isa::avx2 : Isa::scalar);
+            return kernels;
+        }
+
+        // other element types: narrow ones go through the widened kernels,
+        // the rest are converted to float one value at a time
+        template <typename T>
+        float l2_sqr(const T* a, const T* b, size_t n) {
+            if constexpr (is_widened<T>) return widened_active<T>().l2_sqr(a, b, n);
+            else return scalar::l2_sqr(a, b, n);
+        }
+
+        template <typename T>
+        float l1(const T* a, const T* b, size_t n) {
+            if constexpr (is_widened<T>) return widened_active<T>().l1(a, b, n);
+            else return scalar::l1(a, b, n);
+        }
+
+        template <typename T>
+        float dot(const T* a, const T* b, size_t n) {
+            if constexpr (is_widened<T>) return widened_active<T>().dot(a, b, n);
+            else return scalar::dot(a, b, n);
+        }
+
+        template <typename T>
+        float cosine(const T* a, const T* b, size_t n) {
+            return dot(a, b, n) / std::sqrt(dot(a, a, n) * dot(b, b, n));
+        }
+
+        template <typename T>
+        float l2_sqr_bounded(const T* a, const T* b, size_t n, float bound) {
+            if constexpr (is_widened<T>) return bounded(widened_active<T>().l2_sqr, a, b, n, bound);
+            else return l2_sqr(a, b, n);
+        }
+
+        template <typename T>
+        float l1_bounded(const T* a, const T* b, size_t n, float bound) {
+            if constexpr (is_widened<T>) return bounded(widened_active<T>().l1, a, b, n, bound);
+            else return l1(a, b, n);
+        }
+    }
+}
+
+#endif //ARAILIB_SIMD_HPP
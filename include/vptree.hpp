@@ -8,164 +8,1147 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <limits>
 #include <random>
+#include <cstdint>
 #include <chrono>
+#include <numeric>
+#include <fstream>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <new>
 #include <arailib.hpp>
 
 using namespace std;
 using namespace arailib;
 
 namespace vptree {
+    constexpr size_t arena_alignment = 64;
+
+    // row-major point storage in a single 64-byte aligned block.
+    // each row is padded with zeros up to a multiple of the alignment.
+    // the rows and ids are either owned, or a read-only view (e.g. into a mapped index file).
+    template <typename T = float>
+    struct Arena {
+        size_t n = 0;
+        size_t dim = 0;
+        size_t stride = 0;
+        vector<size_t> ids;  // owned ids; empty for a view
+
+        Arena() = default;
+        Arena(const Series<T>& series) { assign(series); }
+
+        // points of another element type are converted like static_cast
+        // the arena is left unchanged if the points differ in dimension
+        template <typename U>
+        void assign(const Series<U>& series) {
+            for (const auto& point : series) {
+                if (point.size() != series.front().size()) throw runtime_error("dimension mismatch");
+            }
+            allocate(series.size(), series.empty() ? 0 : series.front().size());
+            for (size_t i = 0; i < n; i++) {
+                std::transform(series[i].begin(), series[i].end(), row(i), saturate_cast<T, U>);
+                ids[i] = series[i].id;
+            }
+        }
+
+        template <typename U>
+        void assign(const Matrix<U>& matrix) {
+            allocate(matrix.size(), matrix.dim);
+            for (size_t i = 0; i < n; i++) {
+                std::transform(matrix.row(i), matrix.row(i) + dim, row(i), saturate_cast<T, U>);
+                ids[i] = matrix.ids[i];
+            }
+        }
+
+        static size_t stride_of(size_t dim) {
+            constexpr size_t width = arena_alignment / sizeof(T);
+            return (dim + width - 1) / width * width;
+        }
+
+        void allocate(size_t n_rows, size_t n_dim) {
+            n = n_rows;
+            dim = n_dim;
+            stride = stride_of(dim);
+
+            buffer.reset(static_cast<T*>(::operator new[](
+                    n * stride * sizeof(T), align_val_t(arena_alignment))));
+            std::fill(buffer.get(), buffer.get() + n * stride, T(0));
+            ids.assign(n, 0);
+            rows_data = buffer.get();
+            ids_data = ids.data();
+        }
+
+        // refer to rows and ids owned by someone else
+        void attach(const T* rows, const size_t* row_ids, size_t n_rows, size_t n_dim) {
+            buffer.reset();
+            ids.clear();
+            n = n_rows;
+            dim = n_dim;
+            stride = stride_of(dim);
+            rows_data = rows;
+            ids_data = row_ids;
+        }
+
+        // reorder rows so that new row i is old row order[i]
+        void permute(const vector<size_t>& order) {
+            Arena permuted;
+            permuted.allocate(n, dim);
+            for (size_t i = 0; i < n; i++) {
+                std::copy(row(order[i]), row(order[i]) + stride, permuted.row(i));
+                permuted.ids[i] = ids_data[order[i]];
+            }
+            *this = move(permuted);
+        }
+
+        // reorder the dimensions of every row so that new dimension j is old dimension order[j]
+        void permute_dims(const vector<size_t>& order) {
+            vector<T> scratch(dim);
+            for (size_t i = 0; i < n; i++) {
+                auto* p = row(i);
+                for (size_t j = 0; j < dim; j++) scratch[j] = p[order[j]];
+                std::copy(scratch.begin(), scratch.end(), p);
+            }
+        }
+
+        // rows of a view are read-only; the non-const accessors may only be written through when owned
+        T* row(size_t i) { return const_cast<T*>(rows_data) + i * stride; }
+        const T* row(size_t i) const { return rows_data + i * stride; }
+        size_t id(size_t i) const { return ids_data[i]; }
+        size_t size() const { return n; }
+        T* data() { return const_cast<T*>(rows_data); }
+        const T* data() const { return rows_data; }
+        const size_t* id_data() const { return ids_data; }
+
+    private:
+        struct Deleter {
+            void operator()(T* p) const {
+                ::operator delete[](p, align_val_t(arena_alignment));
+            }
+        };
+        unique_ptr<T[], Deleter> buffer;
+        const T* rows_data = nullptr;
+        const size_t* ids_data = nullptr;
+    };
+
+    constexpr int64_t no_node = -1;
+
+    // plain layout shared by memory and index files; children are indices in the node array
     struct Node {
-        const Data<> data;
-        float r;
-        Node* inner;
-        Node* outer;
-        int n_children;
-        Node(Data<>& p) : data(move(p)), inner(nullptr), outer(nullptr),
-                          n_children(0) {}
+        uint64_t row = 0;     // vantage point, or the first row of a leaf bucket
+        uint64_t n_rows = 0;  // number of rows in the leaf bucket, 0 for internal nodes
+        float r = 0;
+        int32_t n_children = 0;
+        int64_t inner = no_node;
+        int64_t outer = no_node;
+        // extent of the distances from the vantage point to the inner and the outer subtree
+        float inner_min = 0;
+        float inner_max = 0;
+        float outer_min = 0;
+        float outer_max = 0;
+
+        bool is_leaf() const { return n_rows > 0; }
     };
 
-    using RefNodes = vector<reference_wrapper<Node>>;
+    using Rows = vector<size_t>;
+
+    // small counter-based generator, so that every subtree gets its own stream
+    // derived from the seed and the subtree position
+    struct SplitMix64 {
+        using result_type = uint64_t;
+        uint64_t state;
+
+        SplitMix64(uint64_t seed) : state(seed) {}
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return UINT64_MAX; }
+
+        result_type operator()() {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        // uniform integer in [0, n), identical on every platform
+        size_t uniform(size_t n) { return static_cast<size_t>((*this)() % n); }
+    };
+
+    constexpr size_t max_depth = 128;
+
+    enum class VantageSelection {
+        random,  // uniformly random point
+        spread   // candidate with the largest distance variance over a test sample (Yianilos 1993)
+    };
+
+    // positions, relative to the start of a subtree, of the vantage candidates and the test sample
+    struct VantageDraw {
+        vector<size_t> candidates;
+        vector<size_t> samples;
+    };
+
+    // binary index file, laid out so that it can be mapped and searched in place:
+    // FileHeader, Node * n_nodes, ids (uint64) * n, rows (float) * n * stride,
+    // pivot distances (float) * n * n_pivots, dimension order (uint64) * dim, checksum (uint64).
+    // each section starts at a multiple of 64 bytes, and the checksum covers everything before it.
+    // values are stored in native byte order, rows as the tree's element type (see value_type_of).
+    // the metric is recorded as a hash of its name (see metric_name), and an index only loads into
+    // a tree with the same metric.
+    constexpr char file_magic[8] = {'V', 'P', 'T', 'R', 'E', 'E', '\0', '\0'};
+    constexpr uint32_t file_version = 7;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint16_t value_size;
+        uint16_t value_type;
+        uint64_t n;
+        uint64_t dim;
+        uint64_t stride;
+        uint64_t leaf_size;
+        uint64_t n_nodes;
+        uint64_t random_state;
+        uint64_t nodes_offset;
+        uint64_t ids_offset;
+        uint64_t rows_offset;
+        uint64_t checksum_offset;
+        uint64_t n_pivots;
+        uint64_t pivots_offset;
+        uint64_t unit_vectors;  // rows were normalized for the metric (see UnitAngular)
+        uint64_t dims_offset;
+        uint64_t metric;  // metric_tag of the tree's metric
+        uint64_t source;  // BasicVPTree::source
+        uint64_t reserved[6];
+    };
+
+    // element type codes in index files
+    template <typename T>
+    constexpr uint16_t value_type_of = is_same<T, float>::value ? 0 : is_same<T, uint8_t>::value ? 1 :
+                                       is_same<T, int16_t>::value ? 2 : is_same<T, half>::value ? 3 : 0xffff;
+
+    static_assert(sizeof(FileHeader) % arena_alignment == 0, "FileHeader must keep sections aligned");
+    static_assert(sizeof(size_t) == sizeof(uint64_t), "ids are stored as uint64");
+
+    inline uint64_t align_offset(uint64_t offset) {
+        return (offset + arena_alignment - 1) / arena_alignment * arena_alignment;
+    }
+
+    // FNV-1a over 64-bit words
+    struct Checksum {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+
+        void update(const void* data, size_t size) {
+            const auto* bytes = static_cast<const unsigned char*>(data);
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t word;
+                memcpy(&word, bytes + i, 8);
+                hash = (hash ^ word) * 0x100000001b3ULL;
+            }
+            for (; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        }
+    };
+
+    // identifies the metric of an index file
+    template <typename Metric>
+    uint64_t metric_tag(const Metric& df) {
+        const auto name = metric_name(df);
+        Checksum checksum;
+        checksum.update(name.data(), name.size());
+        return checksum.hash;
+    }
+
+    // distances from every row to the root vantage point, when they are measured
+    // before the build (see build_pipelined); dists is empty if they are not
+    struct RootDists {
+        size_t vantage = 0;
+        vector<float> dists;
+    };
+
+    // a point being placed during the build, with its distance to the current vantage point
+    struct BuildItem {
+        size_t row;
+        float dist;
+    };
+
+    struct Neighbor {
+        size_t id;
+        float dist;
+
+        bool operator<(const Neighbor& o) const { return dist < o.dist; }
+    };
+
+    // keeps the k nearest neighbors seen so far in a fixed-capacity max-heap.
+    // ties are kept, and the bound is infinite until k neighbors are collected.
+    // n_points caps the reservation, since k may exceed the number of points searched.
+    struct KnnCollector {
+        size_t k;
+        vector<Neighbor> heap;
+
+        KnnCollector(size_t k, size_t n_points) : k(k) { heap.reserve(min(k, n_points)); }
+
+        float bound() const {
+            return heap.size() < k ? numeric_limits<float>::infinity() : heap.front().dist;
+        }
+
+        void push(size_t id, float dist) {
+            if (heap.size() < k) {
+                heap.push_back({id, dist});
+                push_heap(heap.begin(), heap.end());
+            } else if (dist < heap.front().dist) {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = {id, dist};
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        // neighbors in ascending order of distance; leaves the collector empty
+        vector<Neighbor> sorted() {
+            sort_heap(heap.begin(), heap.end());
+            return move(heap);
+        }
+    };
 
     struct SearchResult {
         time_t time = 0;
-        RefSeries<> series;
+        vector<Neighbor> series;
     };
 
-    struct VPTree {
-        vector<Node> nodes;
-        Node* root;
-        const DistanceFunction<> df;
-        mt19937 engine;
+    // Metric is a functor float(const T*, const T*, size_t), e.g.
+    // Euclidean<>, Manhattan<>, Angular<> or a user-defined one.
+    // T is the element type the points are stored as: float, or uint8_t, int16_t or half to save memory;
+    // points and queries of other types are converted to it.
+    template <typename Metric = DynamicDistance, typename T = float>
+    struct BasicVPTree {
+        Arena<T> arena;
+        vector<Node> nodes;  // owned nodes; empty when the index is mapped from a file
+        const Node* root;    // first node, in nodes or in the mapping; nullptr if empty
+        size_t n_nodes = 0;
+        MappedFile mapping;
+        const Metric df;
+        const bool unit_vectors;  // rows and queries are normalized for df
+        unsigned random_state;
+        size_t leaf_size;  // subsets of at most this many points become leaf buckets
+        int n_threads = n_max_threads;  // threads used by build and batch search
+        size_t task_cutoff = 1 << 12;   // subtrees smaller than this are built serially
+        map<size_t, size_t> node_counts;
+        VantageSelection vantage_selection = VantageSelection::random;
+        size_t n_candidates = 8;  // vantage candidates per node for VantageSelection::spread
+        size_t n_samples = 64;    // test points each candidate is measured against
+        // every point keeps its distances to its n_pivots nearest ancestor vantage points (LAESA-style pivots),
+        // at slot depth % n_pivots for the ancestor at that depth. leaf scans use them to reject points
+        // by the triangle inequality before computing their distance.
+        size_t n_pivots = 4;
+        vector<float> pivot_dists;      // owned pivot table; empty when the index is mapped from a file
+        const float* pivots = nullptr;  // pivot table, in pivot_dists or in the mapping
+        size_t pivot_stride = 0;        // n_pivots the table was built with; n_pivots only applies to the next build
+        // leaf scans abandon a distance once it exceeds the search bound. with order_dims, the build
+        // stores dimensions in order of decreasing variance so that the abandon comes sooner;
+        // dim_order[j] is then the original dimension of stored dimension j, and queries are reordered to match.
+        bool order_dims = false;
+        vector<size_t> dim_order;  // empty if the dimensions keep their original order
+        // caller-defined tag of the data the tree was built from (e.g. a hash of its path), 0 if unset.
+        // save stores it and load restores it, so a caller can tell an index built from other data.
+        uint64_t source = 0;
 
-        VPTree(const string& df = "euclidean",
-               const unsigned random_state = 42) :
-               df(select_distance(df)), engine(mt19937(random_state)) {}
+        BasicVPTree(const Metric& df = Metric(),
+                    const unsigned random_state = 42,
+                    const size_t leaf_size = 16) :
+                    root(nullptr), df(df), unit_vectors(is_normalized(df)), random_state(random_state),
+                    leaf_size(max<size_t>(leaf_size, 1)) {
+            if (unit_vectors && !is_floating_point<T>::value) throw runtime_error("normalized metric needs float points");
+        }
 
-        RefNodes make_ref_nodes(vector<Node>& process_nodes) const {
-            RefNodes result;
-            for (auto& pn : process_nodes) result.emplace_back(pn);
-            return result;
+        float distance(size_t row_a, size_t row_b) const {
+            return df(arena.row(row_a), arena.row(row_b), arena.dim);
+        }
+
+        float distance(const Data<T>& query, size_t row) const {
+            return df(query.x.data(), arena.row(row), arena.dim);
+        }
+
+        // a metric specialized for a dimension (see Euclidean) only accepts points of that dimension
+        static void check_dim(size_t dim) {
+            if (fixed_dim<Metric>::value > 0 && dim != fixed_dim<Metric>::value && dim > 0)
+                throw runtime_error("dimension mismatch");
+        }
+
+        // query itself, or a copy in buffer laid out like the rows: converted to T, normalized
+        // if the metric expects unit vectors, and with its dimensions in dim_order
+        template <typename U>
+        const Data<T>& prepare_query(const Data<U>& query, optional<Data<T>>& buffer) const {
+            if (arena.size() > 0 && query.size() != arena.dim) throw runtime_error("query dimension mismatch");
+            if constexpr (is_same<U, T>::value) {
+                if (!unit_vectors && dim_order.empty()) return query;
+            }
+            buffer.emplace(query.id, vector<T>(query.size()));
+            for (size_t j = 0; j < query.size(); j++) {
+                buffer->x[j] = saturate_cast<T>(query.x[dim_order.empty() ? j : dim_order[j]]);
+            }
+            if constexpr (is_floating_point<T>::value) {
+                if (unit_vectors) normalize(buffer->x.data(), buffer->size());
+            }
+            return *buffer;
+        }
+
+        // sorts the dimensions of the rows by decreasing variance
+        void sort_dims() {
+            vector<double> sum(arena.dim, 0), sum_sq(arena.dim, 0);
+            for (size_t row = 0; row < arena.size(); row++) {
+                const auto* p = arena.row(row);
+                for (size_t j = 0; j < arena.dim; j++) {
+                    sum[j] += p[j];
+                    sum_sq[j] += static_cast<double>(p[j]) * p[j];
+                }
+            }
+            vector<double> variance(arena.dim);
+            for (size_t j = 0; j < arena.dim; j++) {
+                const auto mean = sum[j] / max<size_t>(arena.size(), 1);
+                variance[j] = sum_sq[j] / max<size_t>(arena.size(), 1) - mean * mean;
+            }
+            dim_order.resize(arena.dim);
+            iota(dim_order.begin(), dim_order.end(), 0);
+            stable_sort(dim_order.begin(), dim_order.end(), [&](size_t a, size_t b) { return variance[a] > variance[b]; });
+            arena.permute_dims(dim_order);
+        }
+
+        void normalize_rows(size_t begin, size_t end) {
+            if constexpr (is_floating_point<T>::value) {
+                if (!unit_vectors) return;
+#pragma omp parallel for num_threads(n_threads)
+                for (size_t row = begin; row < end; row++) normalize(arena.row(row), arena.dim);
+            }
+        }
+
+        const Node* node_at(int64_t index) const {
+            return index == no_node ? nullptr : root + index;
+        }
+
+        // distances from query to the rows of a leaf bucket at depth, handed to f in chunks.
+        // path[a] is the distance from query to the ancestor vantage point at depth a. rows whose
+        // pivot distances show they are no closer than bound() are skipped without computing their distance;
+        // each run of consecutive remaining rows is measured with one rows_distance call over the arena.
+        template <typename Bound, typename F>
+        void scan_leaf(const Data<T>& query, const Node& node, const float* path, size_t depth,
+                       Bound bound, F f) const {
+            constexpr size_t chunk = 64;
+            size_t rows[chunk];
+            float dists[chunk];
+            const auto first_pivot = depth > pivot_stride ? depth - pivot_stride : 0;
+            for (size_t begin = node.row; begin < node.row + node.n_rows; begin += chunk) {
+                const auto end = min(begin + chunk, node.row + node.n_rows);
+                const auto r = bound();
+                size_t n_kept = 0;
+                for (size_t row = begin; row < end; row++) {
+                    bool kept = true;
+                    for (size_t a = first_pivot; a < depth && kept; a++) {
+                        kept = abs(path[a] - pivots[row * pivot_stride + a % pivot_stride]) < r;
+                    }
+                    if (kept) rows[n_kept++] = row;
+                }
+                for (size_t i = 0, run = 1; i < n_kept; i += run) {
+                    for (run = 1; i + run < n_kept && rows[i + run] == rows[i] + run; run++);
+                    rows_distance(df, query.x.data(), arena.row(rows[i]), arena.stride, run, arena.dim, r, dists + i);
+                }
+                for (size_t i = 0; i < n_kept; i++) f(rows[i], dists[i]);
+            }
         }
 
-        void set_nodes(Series<>& series) {
-            for (auto& point : series) nodes.push_back(Node(point));
+        // number of nodes of a subtree over size points; the shape depends only on size
+        size_t count_nodes(size_t size) {
+            if (size == 0) return 0;
+            if (size <= leaf_size) return 1;
+            const auto found = node_counts.find(size);
+            if (found != node_counts.end()) return found->second;
+            const auto count = 1 + count_nodes(size / 2) + count_nodes(size - 1 - size / 2);
+            node_counts.emplace(size, count);
+            return count;
         }
 
-        void build(Series<>& series) {
-            // set nodes
-            set_nodes(series);
+        // a build that throws before the tree is touched (e.g. on a dimension mismatch) keeps the current tree
+        template <typename U>
+        void build(const Series<U>& series) {
+            check_dim(series.empty() ? 0 : series.front().size());
+            arena.assign(series);
+            normalize_rows(0, arena.size());
+            build_arena();
+        }
 
-            // build
-            auto ref_nodes = make_ref_nodes(nodes);
-            root = build_level(ref_nodes);
+        template <typename U>
+        void build(const Matrix<U>& matrix) {
+            check_dim(matrix.dim);
+            arena.assign(matrix);
+            normalize_rows(0, arena.size());
+            build_arena();
         }
 
         void build(const string& data_path, const int n) {
-            auto series = load_data(data_path, n);
-            build(series);
+            if (is_csv(data_path)) build(parse_csv(data_path, n));
+            else if (is_vecs(data_path)) build(read_vecs<T>(data_path, n));
+            else build(read_csv_dir(data_path, n));
+        }
+
+        // loads a directory of CSV shards (see read_csv_dir_into) straight into the arena and builds the tree,
+        // overlapping the two: the rows drawn for the root vantage point depend only on the seed and the
+        // number of points, so the root vantage point is chosen as soon as those rows are parsed,
+        // and every shard is measured against it by its parsing thread while the other
+        // shards are still loading. the tree is the same as build(path, n).
+        // with order_dims, distances depend on the dimension order, which is only known once every
+        // shard is loaded, so the root is then chosen and measured as in build().
+        void build_pipelined(const string& data_path, const int n_shards) {
+            // the dimension is only known once the shards are counted, after the arena is resized,
+            // so a failed load leaves an empty tree rather than nodes over rows that are gone
+            RootDists measured;
+            try {
+                measured = load_shards(data_path, n_shards);
+            } catch (...) {
+                clear();
+                throw;
+            }
+            build_arena(measured);
+        }
+
+        // the loading half of build_pipelined: fills the arena, and returns the root distances it measured
+        RootDists load_shards(const string& data_path, const int n_shards) {
+            bool started = false, vantage_ready = false;
+            vector<pair<size_t, size_t>> pending;
+            VantageDraw draw;
+            Rows needed_rows;  // rows the root vantage selection looks at, not yet loaded
+            RootDists measured;
+
+            read_csv_dir_into(data_path, n_shards, arena, [&](const Arena<T>& rows, size_t begin, size_t end) {
+                check_dim(rows.dim);  // before any distance over the shard
+                normalize_rows(begin, end);
+
+                // ranges that can be measured now, by this thread
+                vector<pair<size_t, size_t>> ready;
+#pragma omp critical(vptree_build_pipelined)
+                {
+                    if (!started) {
+                        started = true;
+                        if (rows.size() > leaf_size && !order_dims) {
+                            measured.dists.assign(rows.size(), 0);
+                            draw = draw_vantage(0, rows.size());
+                            needed_rows = draw.candidates;
+                            needed_rows.insert(needed_rows.end(), draw.samples.begin(), draw.samples.end());
+                        }
+                    }
+                    if (measured.dists.empty()) {
+                        // nothing to measure
+                    } else if (vantage_ready) {
+                        ready.emplace_back(begin, end);
+                    } else {
+                        pending.emplace_back(begin, end);
+                        needed_rows.erase(remove_if(needed_rows.begin(), needed_rows.end(), [&](size_t row) {
+                            return begin <= row && row < end;
+                        }), needed_rows.end());
+                        if (needed_rows.empty()) {
+                            measured.vantage = pick_vantage(draw, [](size_t row) { return row; });
+                            vantage_ready = true;
+                            ready.swap(pending);
+                        }
+                    }
+                }
+                for (const auto& range : ready) {
+                    for (size_t row = range.first; row < range.second; row++) {
+                        measured.dists[row] = distance(measured.vantage, row);
+                    }
+                }
+            });
+            return measured;
+        }
+
+        // drops the index, leaving an empty tree
+        void clear() {
+            arena.allocate(0, 0);
+            nodes.clear();
+            n_nodes = 0;
+            root = nullptr;
+            node_counts.clear();
+            pivot_dists.clear();
+            pivots = nullptr;
+            pivot_stride = 0;
+            dim_order.clear();
+            mapping = MappedFile();
+        }
+
+        // builds the tree over the points already in arena (normalized, if the metric expects it).
+        // measured holds the root distances if they are already known, for the rows in their current order.
+        void build_arena(const RootDists& measured = RootDists()) {
+            check_dim(arena.dim);
+            if (!measured.dists.empty() && (measured.dists.size() != arena.size() || order_dims))
+                throw runtime_error("root distances do not match the arena");
+
+            // nodes are laid out in preorder, so each subtree knows its slots in advance
+            node_counts.clear();
+            nodes.assign(count_nodes(arena.size()), Node());
+            n_nodes = nodes.size();
+            mapping = MappedFile();
+
+            dim_order.clear();
+            if (order_dims) sort_dims();
+            pivot_stride = n_pivots;
+            pivot_dists.assign(arena.size() * pivot_stride, 0);
+
+            vector<BuildItem> items(arena.size());
+            for (size_t i = 0; i < items.size(); i++) items[i].row = i;
+#pragma omp parallel num_threads(n_threads)
+#pragma omp single
+            build_level(items, 0, items.size(), 0, 0, measured.dists.empty() ? nullptr : &measured);
+            root = nodes.empty() ? nullptr : nodes.data();
+
+            // lay out points in build order, so that every leaf bucket is contiguous
+            Rows order(items.size());
+            for (size_t i = 0; i < items.size(); i++) order[i] = items[i].row;
+            arena.permute(order);
+
+            vector<float> permuted(pivot_dists.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                const auto first = pivot_dists.begin() + order[i] * pivot_stride;
+                std::copy(first, first + pivot_stride, permuted.begin() + i * pivot_stride);
+            }
+            pivot_dists = move(permuted);
+            pivots = pivot_dists.data();
         }
 
-        pair<RefNodes, RefNodes> partition_nodes(const Node& node, float mid_dist,
-                                                 const RefNodes& process_nodes) const {
-            RefNodes inner_nodes, outer_nodes;
-            for (const auto& pn : process_nodes) {
-                if (pn.get().data == node.data) continue;
-                const auto dist = df(node.data, pn.get().data);
-                if (dist <= mid_dist) inner_nodes.push_back(pn);
-                else outer_nodes.push_back(pn);
+        // splits items [begin, end) around the vantage point at begin, so that
+        // inner points (dist <= r) are [begin + 1, mid) and outer points (dist >= r) are [mid, end).
+        // r is the exact median of the distances. returns {mid, r}.
+        pair<size_t, float> partition_items(vector<BuildItem>& items, size_t begin, size_t end,
+                                            const bool has_dists = false) const {
+            const auto vantage_row = items[begin].row;
+            if (has_dists) {
+                // distances are already in items
+            } else if (end - begin > task_cutoff) {
+#pragma omp taskloop grainsize(1024) shared(items)
+                for (size_t i = begin + 1; i < end; i++) {
+                    items[i].dist = distance(vantage_row, items[i].row);
+                }
+            } else {
+                for (size_t i = begin + 1; i < end; i++) {
+                    items[i].dist = distance(vantage_row, items[i].row);
+                }
             }
-            return {inner_nodes, outer_nodes};
+
+            const auto n_inner = (end - begin) / 2;
+            const auto median = items.begin() + begin + n_inner;
+            nth_element(items.begin() + begin + 1, median, items.begin() + end,
+                        [](const BuildItem& a, const BuildItem& b) { return a.dist < b.dist; });
+            return {begin + n_inner + 1, median->dist};
         }
 
-        Node* build_level(RefNodes& process_nodes) {
-            if (process_nodes.size() <= 0) return nullptr;
+        // builds the subtree at depth over items [begin, end) into nodes[index]; items are reordered
+        // in place and the final position of each point is its index in items.
+        // large subtrees are built as OpenMP tasks. measured is only given for the root.
+        int64_t build_level(vector<BuildItem>& items, size_t begin, size_t end, size_t index, size_t depth,
+                            const RootDists* measured = nullptr) {
+            if (end <= begin) return no_node;
+
+            auto* node = &nodes[index];
+            node->row = begin;
+
+            if (end - begin <= leaf_size) {
+                node->n_rows = end - begin;
+                return index;
+            }
 
-            // select process node
-            uniform_int_distribution<size_t> distribution(0, process_nodes.size() - 1);
-            const auto random_id = distribution(engine);
-            auto* node = &(process_nodes[random_id].get());
+            // select vantage point; a root measured before the build keeps the vantage point it was measured
+            // against (items are still in row order there)
+            const bool has_dists = measured != nullptr;
+            const auto vantage = has_dists ? measured->vantage : pick_vantage(
+                    draw_vantage(index, end - begin), [&](size_t i) { return items[begin + i].row; });
+            swap(items[begin], items[begin + vantage]);
 
-            const auto mid_node = process_nodes[process_nodes.size() / 2].get();
-            const float mid_dist = df(node->data, mid_node.data);
-            node->r = mid_dist;
+            if (has_dists) {
+                for (size_t i = begin + 1; i < end; i++) items[i].dist = measured->dists[items[i].row];
+            }
 
             // divide inner or outer
-            auto partitioned = partition_nodes(*node, mid_dist, process_nodes);
+            const auto partitioned = partition_items(items, begin, end, has_dists);
+            const auto mid = partitioned.first;
+            node->r = partitioned.second;
+            set_bounds(*node, items, begin, mid, end);
+            if (pivot_stride > 0) {
+                for (size_t i = begin + 1; i < end; i++) {
+                    pivot_dists[items[i].row * pivot_stride + depth % pivot_stride] = items[i].dist;
+                }
+            }
 
             // calc n_children
-            node->n_children = partitioned.first.size() + partitioned.second.size();
+            node->n_children = end - begin - 1;
 
-            node->inner = build_level(partitioned.first);
-            node->outer = build_level(partitioned.second);
+            const auto inner_index = index + 1;
+            const auto outer_index = inner_index + node_counts_at(mid - begin - 1);
+            if (end - begin > task_cutoff) {
+#pragma omp task shared(items)
+                node->inner = build_level(items, begin + 1, mid, inner_index, depth + 1);
+#pragma omp task shared(items)
+                node->outer = build_level(items, mid, end, outer_index, depth + 1);
+#pragma omp taskwait
+            } else {
+                node->inner = build_level(items, begin + 1, mid, inner_index, depth + 1);
+                node->outer = build_level(items, mid, end, outer_index, depth + 1);
+            }
+
+            return index;
+        }
+
+        // records the distance extents of the inner [begin + 1, mid) and outer [mid, end) items
+        void set_bounds(Node& node, const vector<BuildItem>& items, size_t begin, size_t mid, size_t end) const {
+            const auto extent = [&](size_t first, size_t last, float& lo, float& hi) {
+                lo = numeric_limits<float>::infinity();
+                hi = -numeric_limits<float>::infinity();
+                for (size_t i = first; i < last; i++) {
+                    lo = min(lo, items[i].dist);
+                    hi = max(hi, items[i].dist);
+                }
+            };
+            extent(begin + 1, mid, node.inner_min, node.inner_max);
+            extent(mid, end, node.outer_min, node.outer_max);
+        }
+
+        // the draw depends only on the seed, the node position and the subtree size,
+        // so serial, parallel and pipelined builds produce the same tree.
+        // spread sampling is skipped for subtrees smaller than n_candidates * n_samples,
+        // where it would cost more distances than partitioning the subtree.
+        VantageDraw draw_vantage(size_t index, size_t size) const {
+            auto engine = subtree_engine(index);
+            VantageDraw draw;
+            if (vantage_selection == VantageSelection::random || n_candidates <= 1 ||
+                size < n_candidates * n_samples) {
+                draw.candidates.push_back(engine.uniform(size));
+                return draw;
+            }
+            for (size_t i = 0; i < n_candidates; i++) draw.candidates.push_back(engine.uniform(size));
+            for (size_t i = 0; i < n_samples; i++) draw.samples.push_back(engine.uniform(size));
+            return draw;
+        }
+
+        // position of the chosen candidate; row_at maps a position to its arena row
+        template <typename RowAt>
+        size_t pick_vantage(const VantageDraw& draw, RowAt row_at) const {
+            if (draw.samples.empty()) return draw.candidates.front();
+
+            // in double: at large distances sum_sq / n and mean * mean nearly cancel
+            size_t best = draw.candidates.front();
+            double best_spread = -1;
+            for (const auto candidate : draw.candidates) {
+                double sum = 0, sum_sq = 0;
+                for (const auto sample : draw.samples) {
+                    const double dist = distance(row_at(candidate), row_at(sample));
+                    sum += dist;
+                    sum_sq += dist * dist;
+                }
+                const auto mean = sum / draw.samples.size();
+                const auto spread = sum_sq / draw.samples.size() - mean * mean;
+                if (spread > best_spread) {
+                    best = candidate;
+                    best_spread = spread;
+                }
+            }
+            return best;
+        }
 
-            return node;
+        SplitMix64 subtree_engine(size_t index) const {
+            return SplitMix64(SplitMix64(random_state)() ^ (index * 0xd1b54a32d192ed03ULL));
         }
 
-        SearchResult range_search(const Data<>& query, const float range) {
+        // count_nodes for a size already visited before the build, safe to call from tasks
+        size_t node_counts_at(size_t size) const {
+            if (size == 0) return 0;
+            if (size <= leaf_size) return 1;
+            return node_counts.at(size);
+        }
+
+        template <typename U>
+        SearchResult range_search(const Data<U>& query, const float range) const {
             const auto start = get_now();
             auto result = SearchResult();
-            result.series = range_search_level(query, range, root);
+            range_search(query, range, result.series);
             const auto end = get_now();
             result.time = get_duration(start, end);
             return result;
         }
 
-        RefSeries<> range_search_level(const Data<>& query, const float range, const Node* node) {
-            RefSeries<> result;
-            const auto dist = df(query, node->data);
+        // appends (id, distance) of every point closer than range to result.
+        // result is not cleared, so one buffer can be reused across queries.
+        template <typename U>
+        void range_search(const Data<U>& raw_query, const float range, vector<Neighbor>& result) const {
+            if (!root) return;
+            optional<Data<T>> buffer;
+            const auto& query = prepare_query(raw_query, buffer);
 
-            if (dist < range) result.emplace_back(node->data);
+            // the tree is median balanced, so its depth is at most log2(n) + 1.
+            // nodes are visited in preorder, so path[0, depth) always holds the ancestors of the current node.
+            const Node* stack[max_depth];
+            size_t depths[max_depth];
+            float path[max_depth];
+            size_t top = 0;
+            stack[top] = root;
+            depths[top++] = 0;
 
-            if (dist - range < node->r && node->inner) {
-                const auto inner_result = range_search_level(query, range, node->inner);
-                for (const auto& e : inner_result) result.push_back(e);
-            }
+            while (top > 0) {
+                --top;
+                const auto* node = stack[top];
+                const auto depth = depths[top];
 
-            if (dist + range > node->r && node->outer) {
-                const auto outer_result = range_search_level(query, range, node->outer);
-                for (const auto& e : outer_result) result.push_back(e);
-            }
+                if (node->is_leaf()) {
+                    scan_leaf(query, *node, path, depth, [&]() { return range; }, [&](size_t row, float dist) {
+                        if (dist < range) result.push_back({arena.id(row), dist});
+                    });
+                    continue;
+                }
 
-            return result;
-        }
+                const auto dist = distance(query, node->row);
+                path[depth] = dist;
 
-        using ResultMap = map<float, reference_wrapper<const Data<>>>;
+                if (dist < range) result.push_back({arena.id(node->row), dist});
 
-        // recursive method for knn search
-        void _knn_search(const Data<>& query, int k, const Node* node, ResultMap& result) {
+                if (node->outer != no_node && dist + range > node->outer_min && dist - range < node->outer_max) {
+                    stack[top] = node_at(node->outer);
+                    depths[top++] = depth + 1;
+                }
+                if (node->inner != no_node && dist + range > node->inner_min && dist - range < node->inner_max) {
+                    stack[top] = node_at(node->inner);
+                    depths[top++] = depth + 1;
+                }
+            }
+        }
+
+        // recursive method for knn search; path[0, depth) holds the distances to the ancestors of node
+        void _knn_search(const Data<T>& query, const Node* node, KnnCollector& result,
+                         float* path, size_t depth) const {
             if (!node) return;
-            const auto dist = df(query, node->data);
 
-            if (result.size() < k) result.emplace(dist, node->data);
-            else if (dist < (--result.cend())->first) {
-                result.erase(--result.cend());
-                result.emplace(dist, node->data);
+            if (node->is_leaf()) {
+                scan_leaf(query, *node, path, depth, [&]() { return result.bound(); }, [&](size_t row, float dist) {
+                    result.push(arena.id(row), dist);
+                });
+                return;
             }
 
-            const auto tail_dist = (--result.cend())->first;
+            const auto dist = distance(query, node->row);
+            result.push(arena.id(node->row), dist);
+            path[depth] = dist;
 
-            if (dist - tail_dist <= node->r && node->inner)
-                _knn_search(query, k, node->inner, result);
+            if (dist + result.bound() >= node->inner_min && dist - result.bound() <= node->inner_max)
+                _knn_search(query, node_at(node->inner), result, path, depth + 1);
 
-            if (dist + tail_dist >= node->r && node->outer)
-                _knn_search(query, k, node->outer, result);
+            if (dist + result.bound() >= node->outer_min && dist - result.bound() <= node->outer_max)
+                _knn_search(query, node_at(node->outer), result, path, depth + 1);
         }
 
-        SearchResult knn_search(const Data<>& query, int k) {
+        template <typename U>
+        SearchResult knn_search(const Data<U>& raw_query, int k) const {
             const auto start = get_now();
             auto result = SearchResult();
 
-            ResultMap result_map;
-            _knn_search(query, k, root, result_map);
-            for (const auto& e : result_map) result.series.emplace_back(e.second);
+            if (k > 0) {
+                optional<Data<T>> buffer;
+                const auto& query = prepare_query(raw_query, buffer);
+                KnnCollector collector(k, arena.size());
+                float path[max_depth];
+                _knn_search(query, root, collector, path, 0);
+                result.series = collector.sorted();
+            }
 
             const auto end = get_now();
             result.time = get_duration(start, end);
             return result;
         }
+
+        // best-first knn search: pending subtrees are expanded in order of their
+        // triangle-inequality lower bound (from the subtree's distance extent), until the next bound reaches the k-th distance
+        template <typename U>
+        SearchResult knn_search_best_first(const Data<U>& raw_query, int k) const {
+            const auto start = get_now();
+            auto result = SearchResult();
+
+            if (k > 0 && root) {
+                optional<Data<T>> buffer;
+                const auto& query = prepare_query(raw_query, buffer);
+                // distances to expanded vantage points, each linked to the entry of its parent
+                struct Visited {
+                    int64_t parent;
+                    float dist;
+                };
+                struct Pending {
+                    float lower_bound;
+                    const Node* node;
+                    size_t depth;
+                    int64_t parent;  // entry in visited of the node's parent
+                };
+                const auto farther = [](const Pending& a, const Pending& b) { return a.lower_bound > b.lower_bound; };
+                vector<Visited> visited;
+                vector<Pending> queue;
+                queue.push_back({0, root, 0, no_node});
+
+                KnnCollector collector(k, arena.size());
+                float path[max_depth];
+                while (!queue.empty()) {
+                    pop_heap(queue.begin(), queue.end(), farther);
+                    const auto pending = queue.back();
+                    const auto lower_bound = pending.lower_bound;
+                    const auto* node = pending.node;
+                    queue.pop_back();
+                    if (lower_bound >= collector.bound()) break;
+
+                    if (node->is_leaf()) {
+                        // only the nearest pivot_stride ancestors are used by the scan
+                        auto entry = pending.parent;
+                        for (size_t a = pending.depth; a > 0 && a + pivot_stride > pending.depth; a--) {
+                            path[a - 1] = visited[entry].dist;
+                            entry = visited[entry].parent;
+                        }
+                        scan_leaf(query, *node, path, pending.depth, [&]() { return collector.bound(); },
+                                  [&](size_t row, float dist) { collector.push(arena.id(row), dist); });
+                        continue;
+                    }
+
+                    const auto dist = distance(query, node->row);
+                    collector.push(arena.id(node->row), dist);
+                    const int64_t entry = visited.size();
+                    visited.push_back({pending.parent, dist});
+
+                    const auto inner_bound = max({lower_bound, dist - node->inner_max, node->inner_min - dist});
+                    const auto outer_bound = max({lower_bound, dist - node->outer_max, node->outer_min - dist});
+                    if (node->inner != no_node && inner_bound < collector.bound()) {
+                        queue.push_back({inner_bound, node_at(node->inner), pending.depth + 1, entry});
+                        push_heap(queue.begin(), queue.end(), farther);
+                    }
+                    if (node->outer != no_node && outer_bound < collector.bound()) {
+                        queue.push_back({outer_bound, node_at(node->outer), pending.depth + 1, entry});
+                        push_heap(queue.begin(), queue.end(), farther);
+                    }
+                }
+                result.series = collector.sorted();
+            }
+
+            const auto end = get_now();
+            result.time = get_duration(start, end);
+            return result;
+        }
+
+        // f(i) for every i < n on n_threads threads. exceptions must not leave the parallel region,
+        // so they are collected per query and the first one is rethrown after it.
+        template <typename F>
+        void for_each_query(size_t n, F f) const {
+            vector<exception_ptr> errors(n);
+#pragma omp parallel for schedule(dynamic, 16) num_threads(n_threads)
+            for (size_t i = 0; i < n; i++) {
+                try {
+                    f(i);
+                } catch (...) {
+                    errors[i] = current_exception();
+                }
+            }
+            for (const auto& error : errors) if (error) rethrow_exception(error);
+        }
+
+        // searches every query on n_threads threads; results[i] belongs to queries[i]
+        template <typename U>
+        vector<SearchResult> batch_range_search(const Series<U>& queries, const float range) const {
+            vector<SearchResult> results(queries.size());
+            for_each_query(queries.size(), [&](size_t i) { results[i] = range_search(queries[i], range); });
+            return results;
+        }
+
+        template <typename U>
+        vector<SearchResult> batch_knn_search(const Series<U>& queries, const int k,
+                                              const bool best_first = true) const {
+            vector<SearchResult> results(queries.size());
+            for_each_query(queries.size(), [&](size_t i) {
+                results[i] = best_first ? knn_search_best_first(queries[i], k)
+                                        : knn_search(queries[i], k);
+            });
+            return results;
+        }
+
+        // writes the tree structure, radii, vectors and pivot table to a binary index file.
+        // only a tag of the metric is stored; load the file into a tree with the same metric.
+        void save(const string& path) const {
+            ofstream ofs(path, ios::binary);
+            if (!ofs) throw runtime_error("Can't open file!");
+
+            FileHeader header{};
+            memcpy(header.magic, file_magic, sizeof(file_magic));
+            header.version = file_version;
+            header.value_size = sizeof(T);
+            header.value_type = value_type_of<T>;
+            header.n = arena.size();
+            header.dim = arena.dim;
+            header.stride = arena.stride;
+            header.leaf_size = leaf_size;
+            header.n_nodes = n_nodes;
+            header.random_state = random_state;
+            header.nodes_offset = align_offset(sizeof(FileHeader));
+            header.ids_offset = align_offset(header.nodes_offset + n_nodes * sizeof(Node));
+            header.rows_offset = align_offset(header.ids_offset + header.n * sizeof(uint64_t));
+            header.n_pivots = pivot_stride;
+            header.unit_vectors = unit_vectors;
+            header.metric = metric_tag(df);
+            header.source = source;
+            header.pivots_offset = align_offset(header.rows_offset + header.n * header.stride * sizeof(T));
+            header.dims_offset = align_offset(header.pivots_offset + header.n * pivot_stride * sizeof(float));
+            header.checksum_offset = header.dims_offset + header.dim * sizeof(uint64_t);
+
+            Checksum checksum;
+            uint64_t offset = 0;
+            const auto write = [&](const void* data, size_t size) {
+                ofs.write(static_cast<const char*>(data), size);
+                checksum.update(data, size);
+                offset += size;
+            };
+            const auto pad_to = [&](uint64_t target) {
+                const char zeros[arena_alignment] = {};
+                write(zeros, target - offset);
+            };
+
+            write(&header, sizeof(header));
+            pad_to(header.nodes_offset);
+            write(root, n_nodes * sizeof(Node));
+            pad_to(header.ids_offset);
+            write(arena.id_data(), header.n * sizeof(uint64_t));
+            pad_to(header.rows_offset);
+            write(arena.data(), header.n * header.stride * sizeof(T));
+            pad_to(header.pivots_offset);
+            write(pivots, header.n * pivot_stride * sizeof(float));
+            pad_to(header.dims_offset);
+            vector<size_t> dims(dim_order);
+            if (dims.empty()) {
+                dims.resize(header.dim);
+                iota(dims.begin(), dims.end(), 0);
+            }
+            write(dims.data(), header.dim * sizeof(uint64_t));
+
+            ofs.write(reinterpret_cast<const char*>(&checksum.hash), sizeof(checksum.hash));
+            if (!ofs) throw runtime_error("Can't write file!");
+        }
+
+        // copies an index file into memory, verifying its checksum
+        void load(const string& path) {
+            const MappedFile file(path);
+            const auto& header = check_index(file, true);
+
+            const auto* file_nodes = reinterpret_cast<const Node*>(file.data() + header.nodes_offset);
+            nodes.assign(file_nodes, file_nodes + header.n_nodes);
+
+            arena.allocate(header.n, header.dim);
+            if (header.n > 0) {
+                memcpy(arena.ids.data(), file.data() + header.ids_offset, header.n * sizeof(uint64_t));
+                memcpy(arena.data(), file.data() + header.rows_offset, header.n * header.stride * sizeof(T));
+            }
+            const auto* file_pivots = reinterpret_cast<const float*>(file.data() + header.pivots_offset);
+            pivot_dists.assign(file_pivots, file_pivots + header.n * header.n_pivots);
+            pivots = pivot_dists.data();
+
+            mapping = MappedFile();
+            set_index(header, nodes.data(), reinterpret_cast<const uint64_t*>(file.data() + header.dims_offset));
+        }
+
+        // searches an index file in place: nodes and vectors stay in the page cache and can be
+        // shared by every process mapping the same file. populate reads the whole file up front;
+        // otherwise pages are faulted in on demand. the checksum is not verified here;
+        // the current index stays in use if the new file is rejected.
+        void load_mapped(const string& path, const bool populate = false) {
+            MappedFile file(path, populate);
+            if (!populate) file.advise(MADV_RANDOM);
+            check_index(file, false);
+            mapping = move(file);
+            const auto& header = *reinterpret_cast<const FileHeader*>(mapping.data());
+
+            nodes.clear();
+            pivot_dists.clear();
+            pivots = reinterpret_cast<const float*>(mapping.data() + header.pivots_offset);
+            arena.attach(reinterpret_cast<const T*>(mapping.data() + header.rows_offset),
+                         reinterpret_cast<const size_t*>(mapping.data() + header.ids_offset),
+                         header.n, header.dim);
+            set_index(header, reinterpret_cast<const Node*>(mapping.data() + header.nodes_offset),
+                      reinterpret_cast<const uint64_t*>(mapping.data() + header.dims_offset));
+        }
+
+        const FileHeader& check_index(const MappedFile& file, const bool verify) const {
+            if (file.size() < sizeof(FileHeader)) throw runtime_error("not an index file");
+            const auto& header = *reinterpret_cast<const FileHeader*>(file.data());
+            if (memcmp(header.magic, file_magic, sizeof(file_magic)) != 0)
+                throw runtime_error("not an index file");
+            if (header.version != file_version) throw runtime_error("unsupported index file version");
+            if (header.value_size != sizeof(T) || header.value_type != value_type_of<T>)
+                throw runtime_error("index value type mismatch");
+            if (header.stride != Arena<T>::stride_of(header.dim)) throw runtime_error("index row stride mismatch");
+            if (header.unit_vectors != unit_vectors || header.metric != metric_tag(df))
+                throw runtime_error("index metric mismatch");
+            check_dim(header.dim);
+            // whether a section of count * size bytes at offset ends by limit; the header fields are
+            // untrusted, so a product that overflows (and could wrap back to a plausible size) fails
+            const auto fits = [](uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+                uint64_t bytes, end;
+                return !__builtin_mul_overflow(count, size, &bytes) && !__builtin_add_overflow(offset, bytes, &end) &&
+                       end <= limit;
+            };
+            uint64_t n_values, n_pivot_dists;
+            if (header.nodes_offset % arena_alignment || header.ids_offset % arena_alignment ||
+                header.rows_offset % arena_alignment || header.pivots_offset % arena_alignment ||
+                header.dims_offset % arena_alignment ||
+                __builtin_mul_overflow(header.n, header.stride, &n_values) ||
+                __builtin_mul_overflow(header.n, header.n_pivots, &n_pivot_dists) ||
+                !fits(header.nodes_offset, header.n_nodes, sizeof(Node), header.ids_offset) ||
+                !fits(header.ids_offset, header.n, sizeof(uint64_t), header.rows_offset) ||
+                !fits(header.rows_offset, n_values, sizeof(T), header.pivots_offset) ||
+                !fits(header.pivots_offset, n_pivot_dists, sizeof(float), header.dims_offset) ||
+                !fits(header.dims_offset, header.dim, sizeof(uint64_t), header.checksum_offset) ||
+                header.checksum_offset != file.size() - sizeof(uint64_t))
+                throw runtime_error("corrupt index file");
+
+            if (verify) {
+                Checksum checksum;
+                checksum.update(file.data(), header.checksum_offset);
+                uint64_t stored;
+                memcpy(&stored, file.data() + header.checksum_offset, sizeof(stored));
+                if (stored != checksum.hash) throw runtime_error("index file checksum mismatch");
+            }
+
+            // nodes are in preorder, so every child comes after its parent; this also rules out cycles.
+            // searches keep per-depth state in arrays of max_depth entries, so deeper trees are rejected.
+            const auto* file_nodes = reinterpret_cast<const Node*>(file.data() + header.nodes_offset);
+            vector<uint32_t> depths(header.n_nodes, 0);
+            const auto valid_child = [&](size_t parent, int64_t index) {
+                if (index == no_node) return true;
+                if (index <= static_cast<int64_t>(parent) || static_cast<uint64_t>(index) >= header.n_nodes) return false;
+                depths[index] = max(depths[index], depths[parent] + 1);
+                return true;
+            };
+            for (size_t i = 0; i < header.n_nodes; i++) {
+                const auto& node = file_nodes[i];
+                if (depths[i] + 1 >= max_depth || !valid_child(i, node.inner) || !valid_child(i, node.outer) ||
+                    node.row >= header.n || node.n_rows > header.n - node.row)
+                    throw runtime_error("corrupt index file");
+            }
+            const auto* dims = reinterpret_cast<const uint64_t*>(file.data() + header.dims_offset);
+            for (size_t j = 0; j < header.dim; j++) {
+                if (dims[j] >= header.dim) throw runtime_error("corrupt index file");
+            }
+            return header;
+        }
+
+        void set_index(const FileHeader& header, const Node* first_node, const uint64_t* dims) {
+            dim_order.assign(dims, dims + header.dim);
+            bool identity = true;
+            for (size_t j = 0; j < dim_order.size(); j++) identity = identity && dim_order[j] == j;
+            if (identity) dim_order.clear();
+            leaf_size = header.leaf_size;
+            random_state = header.random_state;
+            source = header.source;
+            n_pivots = pivot_stride = header.n_pivots;
+            node_counts.clear();
+            n_nodes = header.n_nodes;
+            root = n_nodes ? first_node : nullptr;
+        }
     };
+
+    // distance selected at runtime by name ("euclidean", "manhattan", "angular")
+    using VPTree = BasicVPTree<>;
 }
 
 #endif //VPTREE_VPTREE_HPP
@@ -18,6 +18,14 @@ void save_results(const string& save_path, const vector<SearchResult>& results)
     }
 }
 
+// identifies the inputs an index file is built from, so that an index built from other data is rebuilt
+uint64_t source_tag(const string& data_path, unsigned n, const string& vantage_selection) {
+    const auto source = data_path + '\n' + to_string(n) + '\n' + vantage_selection;
+    Checksum checksum;
+    checksum.update(source.data(), source.size());
+    return checksum.hash;
+}
+
 int main() {
     const auto config = read_config();
     const string data_path = config["data_path"];
@@ -28,16 +36,35 @@ int main() {
     const float range = config["range"];
     const string& distance = config["distance"];
 
-    const auto queries = read_csv(query_path, n_query);
+    const auto queries = load_data(query_path, n_query);
 
     auto vpt = VPTree(distance);
-    vpt.build(data_path, n);
-    cout << "complete: build" << endl;
+    const string vantage_selection = config.value("vantage_selection", "random");
+    if (vantage_selection == "spread") vpt.vantage_selection = VantageSelection::spread;
+    const auto source = source_tag(data_path, n, vantage_selection);
 
-    vector<SearchResult> results(queries.size());
-    for (const auto& query : queries) {
-        results[query.id] = vpt.range_search(query, range);
+    const string index_path = config.value("index_path", "");
+    bool loaded = false;
+    if (!index_path.empty() && ifstream(index_path)) {
+        // an index built with another distance or from other inputs (or an unreadable one) is rebuilt and overwritten
+        try {
+            vpt.load(index_path);
+            if (vpt.source != source) throw runtime_error("built from another data_path, n or vantage_selection");
+            loaded = true;
+            cout << "complete: load" << endl;
+        } catch (const exception& e) {
+            cerr << index_path << ": " << e.what() << ", rebuilding" << endl;
+        }
     }
+    if (!loaded) {
+        vpt.source = source;
+        if (is_csv(data_path) || is_vecs(data_path)) vpt.build(data_path, n);
+        else vpt.build_pipelined(data_path, n);
+        cout << "complete: build" << endl;
+        if (!index_path.empty()) vpt.save(index_path);
+    }
+
+    const auto results = vpt.batch_range_search(queries, range);
 
     save_results(save_path, results);
 }
\ No newline at end of file
@@ -2,11 +2,39 @@
 #include <random>
 #include <arailib.hpp>
 #include <vptree.hpp>
+#include <mvptree.hpp>
 
 using namespace std;
 using namespace arailib;
 using namespace vptree;
 
+Series<> make_random_series(size_t n, size_t dim, unsigned seed = 42) {
+    mt19937 engine(seed);
+    normal_distribution<float> distribution(0, 1);
+    auto series = Series<>();
+    for (size_t i = 0; i < n; i++) {
+        vector<float> x(dim);
+        for (auto& e : x) e = distribution(engine);
+        series.push_back(Data<>(i, x));
+    }
+    return series;
+}
+
+vector<size_t> brute_range_search(const Series<>& series, const Data<>& query, float range) {
+    vector<size_t> result;
+    for (const auto& point : series) {
+        if (euclidean_distance(query, point) < range) result.push_back(point.id);
+    }
+    return result;
+}
+
+vector<size_t> sorted_ids(const vector<Neighbor>& neighbors) {
+    vector<size_t> result;
+    for (const auto& neighbor : neighbors) result.push_back(neighbor.id);
+    sort(result.begin(), result.end());
+    return result;
+}
+
 TEST(vptree, partition) {
     const auto p0 = Data<>(0, {0});
     const auto p1 = Data<>(1, {1});
@@ -16,15 +44,30 @@ TEST(vptree, partition) {
     auto series = Series<>{p0, p1, p2, p3, p4};
 
     auto vpt = VPTree();
-    vpt.set_nodes(series);
+    vpt.arena.assign(series);
+
+    auto items = vector<BuildItem>{{2, 0}, {0, 0}, {4, 0}, {1, 0}, {3, 0}};
+    const auto partitioned = vpt.partition_items(items, 0, items.size());
+    const auto mid = partitioned.first;
+
+    ASSERT_EQ(mid - 1, 2);
+    ASSERT_EQ(items.size() - mid, 2);
+    ASSERT_EQ(partitioned.second, 1);
+    for (size_t i = 1; i < mid; i++) ASSERT_LE(items[i].dist, partitioned.second);
+    for (size_t i = mid; i < items.size(); i++) ASSERT_GE(items[i].dist, partitioned.second);
+}
 
-    const auto ref_nodes = vpt.make_ref_nodes(vpt.nodes);
-    const auto partitioned = vpt.partition_nodes(vpt.nodes[2], 1, ref_nodes);
-    const auto inner_nodes = partitioned.first;
-    const auto outer_nodes = partitioned.second;
+TEST(vptree, arena) {
+    auto series = Series<>{Data<>(7, {1, 2, 3}), Data<>(9, {4, 5, 6})};
+    const auto arena = Arena<>(series);
 
-    ASSERT_EQ(inner_nodes.size(), 2);
-    ASSERT_EQ(outer_nodes.size(), 2);
+    ASSERT_EQ(arena.size(), 2);
+    ASSERT_EQ(arena.dim, 3);
+    ASSERT_EQ(arena.stride % (arena_alignment / sizeof(float)), 0);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(arena.row(1)) % arena_alignment, 0);
+    ASSERT_EQ(arena.row(1)[2], 6);
+    ASSERT_EQ(arena.row(1)[3], 0);
+    ASSERT_EQ(arena.ids[1], 9);
 }
 
 TEST(vptree, search) {
@@ -95,6 +138,971 @@ TEST(vptree, knn_search) {
     int k = 2;
     const auto result = vpt.knn_search(query, k);
     ASSERT_EQ(result.series.size(), k);
-    ASSERT_EQ(result.series[0].get().id, 0);
-    ASSERT_EQ(result.series[1].get().id, 4);
-}
\ No newline at end of file
+    ASSERT_EQ(result.series[0].id, 0);
+    ASSERT_EQ(result.series[1].id, 4);
+
+    // k beyond the number of points returns them all
+    const int huge_k = 2000000000;
+    ASSERT_EQ(vpt.knn_search(query, huge_k).series.size(), series.size());
+    ASSERT_EQ(vpt.knn_search_best_first(query, huge_k).series.size(), series.size());
+}
+
+struct Chebyshev {
+    float operator()(const float* p1, const float* p2, size_t n) const {
+        float result = 0;
+        for (size_t i = 0; i < n; i++) result = max(result, abs(p1[i] - p2[i]));
+        return result;
+    }
+};
+
+TEST(vptree, unit_angular) {
+    auto series = make_random_series(2000, 16);
+    for (auto& point : series) point.x[0] += 2;  // keep the angles away from uniform
+    const auto queries = make_random_series(20, 16, 1);
+    const string path = testing::TempDir() + "vptree_unit_angular.bin";
+
+    auto vpt = VPTree("angular");
+    vpt.build(series);
+    for (size_t row = 0; row < vpt.arena.size(); row++) {
+        ASSERT_NEAR(l2_norm(vpt.arena.row(row), vpt.arena.dim), 1, 1e-5);
+    }
+    auto mvpt = MVPTree("angular");
+    mvpt.build(series);
+
+    for (const auto& query : queries) {
+        vector<float> dists;
+        for (const auto& point : series) dists.push_back(angular_distance(query, point));
+        sort(dists.begin(), dists.end());
+        for (const auto& result : {vpt.knn_search(query, 10), vpt.knn_search_best_first(query, 10),
+                                   mvpt.knn_search(query, 10)}) {
+            ASSERT_EQ(result.series.size(), 10);
+            for (int i = 0; i < 10; i++) ASSERT_NEAR(result.series[i].dist, dists[i], 1e-4);
+        }
+    }
+
+    // an index of normalized rows can't be searched with a raw metric
+    vpt.save(path);
+    auto raw = BasicVPTree<Angular<>>();
+    ASSERT_THROW(raw.load(path), runtime_error);
+    remove(path.c_str());
+}
+
+TEST(vptree, static_metric) {
+    int n_rows = 4, n_cols = 4;
+    size_t id = 0;
+    auto series = Series<>();
+    for (int i = 0; i < n_rows; i++) {
+        for (int j = 0; j < n_cols; j++) {
+            series.push_back(Data<>(id, {float(i), float(j)}));
+            id++;
+        }
+    }
+    const auto query = Data<>(0, {1.5, 1.5});
+
+    auto euclidean_vpt = BasicVPTree<Euclidean<>>();
+    euclidean_vpt.build(series);
+    ASSERT_EQ(euclidean_vpt.range_search(query, 1).series.size(), 4);
+
+    auto chebyshev_vpt = BasicVPTree<Chebyshev>();
+    chebyshev_vpt.build(series);
+    ASSERT_EQ(chebyshev_vpt.range_search(query, 1).series.size(), 4);
+    ASSERT_EQ(chebyshev_vpt.range_search(query, 1.6).series.size(), 16);
+}
+
+TEST(simd, kernels) {
+    mt19937 engine(42);
+    normal_distribution<float> distribution(0, 1);
+    const auto reference = simd::kernels_for(simd::Isa::scalar);
+
+    for (auto isa : {simd::Isa::sse, simd::Isa::avx2, simd::Isa::avx512}) {
+        if (!simd::is_supported(isa)) continue;
+        const auto kernels = simd::kernels_for(isa);
+        for (size_t n : {1, 3, 8, 15, 16, 17, 128, 131}) {
+            vector<float> a(n), b(n);
+            for (auto& e : a) e = distribution(engine);
+            for (auto& e : b) e = distribution(engine);
+            ASSERT_NEAR(kernels.l2_sqr(a.data(), b.data(), n), reference.l2_sqr(a.data(), b.data(), n), 1e-3);
+            ASSERT_NEAR(kernels.l1(a.data(), b.data(), n), reference.l1(a.data(), b.data(), n), 1e-3);
+            ASSERT_NEAR(kernels.dot(a.data(), b.data(), n), reference.dot(a.data(), b.data(), n), 1e-3);
+            ASSERT_NEAR(kernels.cosine(a.data(), b.data(), n), reference.cosine(a.data(), b.data(), n), 1e-5);
+        }
+    }
+}
+
+template <size_t Dim = 0>
+void check_rows_kernels(mt19937& engine, size_t n) {
+    normal_distribution<float> distribution(0, 1);
+    const size_t n_rows = 7, stride = n + 5;
+    vector<float> query(n), rows(n_rows * stride);
+    for (auto& e : query) e = distribution(engine);
+    for (auto& e : rows) e = distribution(engine);
+    const auto reference = simd::kernels_for(simd::Isa::scalar);
+    for (auto isa : {simd::Isa::scalar, simd::Isa::sse, simd::Isa::avx2, simd::Isa::avx512}) {
+        if (!simd::is_supported(isa)) continue;
+        const auto kernels = simd::rows_kernels_for<Dim>(isa);
+        vector<float> l2(n_rows), l1(n_rows);
+        kernels.l2_sqr(query.data(), rows.data(), stride, n_rows, n, numeric_limits<float>::infinity(), l2.data());
+        kernels.l1(query.data(), rows.data(), stride, n_rows, n, numeric_limits<float>::infinity(), l1.data());
+        for (size_t r = 0; r < n_rows; r++) {
+            ASSERT_NEAR(l2[r], reference.l2_sqr(query.data(), rows.data() + r * stride, n), 1e-3);
+            ASSERT_NEAR(l1[r], reference.l1(query.data(), rows.data() + r * stride, n), 1e-3);
+        }
+
+        // a sum above the bound may be abandoned, but stays above it
+        const auto bound = *min_element(l2.begin(), l2.end()) * 1.01f;
+        vector<float> bounded(n_rows);
+        kernels.l2_sqr(query.data(), rows.data(), stride, n_rows, n, bound, bounded.data());
+        for (size_t r = 0; r < n_rows; r++) {
+            if (l2[r] <= bound) ASSERT_NEAR(bounded[r], l2[r], 1e-3);
+            else ASSERT_GT(bounded[r], bound);
+        }
+    }
+}
+
+TEST(simd, rows) {
+    mt19937 engine(42);
+    for (size_t n : {1, 3, 8, 17, 64, 131, 200}) check_rows_kernels(engine, n);
+    check_rows_kernels<16>(engine, 16);
+    check_rows_kernels<131>(engine, 131);
+
+    // Euclidean and DynamicDistance measure a leaf through the same kernels
+    const auto series = make_random_series(9, 40);
+    Arena<> arena(series);
+    vector<float> dists(arena.size()), dynamic(arena.size());
+    Euclidean<>().rows(series[0].x.data(), arena.row(0), arena.stride, arena.size(), arena.dim,
+                       numeric_limits<float>::infinity(), dists.data());
+    DynamicDistance().rows(series[0].x.data(), arena.row(0), arena.stride, arena.size(), arena.dim,
+                           numeric_limits<float>::infinity(), dynamic.data());
+    for (size_t i = 0; i < arena.size(); i++) {
+        ASSERT_NEAR(dists[i], euclidean_distance(series[0], series[i]), 1e-4);
+        ASSERT_NEAR(dynamic[i], dists[i], 1e-4);
+    }
+}
+
+template <size_t Dim>
+void check_fixed_kernels(mt19937& engine) {
+    normal_distribution<float> distribution(0, 1);
+    vector<float> a(Dim), b(Dim);
+    for (auto& e : a) e = distribution(engine);
+    for (auto& e : b) e = distribution(engine);
+    for (auto isa : {simd::Isa::scalar, simd::Isa::sse, simd::Isa::avx2, simd::Isa::avx512}) {
+        if (!simd::is_supported(isa)) continue;
+        const auto fixed = simd::kernels_for<Dim>(isa);
+        const auto dynamic = simd::kernels_for(isa);
+        ASSERT_NEAR(fixed.l2_sqr(a.data(), b.data(), Dim), dynamic.l2_sqr(a.data(), b.data(), Dim), 1e-3);
+        ASSERT_NEAR(fixed.l1(a.data(), b.data(), Dim), dynamic.l1(a.data(), b.data(), Dim), 1e-3);
+        ASSERT_NEAR(fixed.dot(a.data(), b.data(), Dim), dynamic.dot(a.data(), b.data(), Dim), 1e-3);
+        ASSERT_NEAR(fixed.cosine(a.data(), b.data(), Dim), dynamic.cosine(a.data(), b.data(), Dim), 1e-5);
+    }
+    const auto l2 = euclidean_distance(a.data(), b.data(), Dim);
+    const auto metric = Euclidean<float, Dim>();
+    ASSERT_NEAR(metric(a.data(), b.data(), Dim), l2, 1e-4);
+    ASSERT_NEAR(metric.bounded(a.data(), b.data(), Dim, l2 * 1.01f), l2, 1e-4);
+    ASSERT_GE(metric.bounded(a.data(), b.data(), Dim, l2 * 0.5f), l2 * 0.5f);
+}
+
+TEST(simd, fixed_dim) {
+    mt19937 engine(42);
+    check_fixed_kernels<3>(engine);
+    check_fixed_kernels<16>(engine);
+    check_fixed_kernels<96>(engine);
+    check_fixed_kernels<128>(engine);
+    check_fixed_kernels<131>(engine);
+}
+
+TEST(vptree, fixed_dim) {
+    const auto series = make_random_series(2000, 16);
+    const auto queries = make_random_series(20, 16, 1);
+
+    auto vpt = BasicVPTree<Euclidean<float, 16>>();
+    vpt.build(series);
+    for (const auto& query : queries) {
+        ASSERT_EQ(sorted_ids(vpt.range_search(query, 4).series), brute_range_search(series, query, 4));
+    }
+
+    const auto short_query = Data<>(0, {1, 2, 3, 4});
+    ASSERT_THROW(vpt.knn_search(short_query, 5), runtime_error);
+    ASSERT_THROW(vpt.range_search(short_query, 4), runtime_error);
+
+    auto mismatched = BasicVPTree<Euclidean<float, 8>>();
+    ASSERT_THROW(mismatched.build(series), runtime_error);
+
+    // a rejected rebuild keeps the current tree
+    const auto series8 = make_random_series(500, 8);
+    auto rebuilt = BasicVPTree<Euclidean<float, 8>>();
+    rebuilt.build(series8);
+    ASSERT_THROW(rebuilt.build(make_random_series(500, 4)), runtime_error);
+    auto ragged = series8;
+    ragged.back().x.pop_back();
+    ASSERT_THROW(rebuilt.build(ragged), runtime_error);
+    const auto query8 = make_random_series(1, 8, 1)[0];
+    ASSERT_EQ(sorted_ids(rebuilt.range_search(query8, 3).series), brute_range_search(series8, query8, 3));
+}
+
+template <typename T>
+void check_widened_kernels(mt19937& engine) {
+    uniform_int_distribution<int> distribution(0, 255);
+    for (size_t n : {5, 16, 40, 131}) {
+        vector<T> a(n), b(n);
+        for (auto& e : a) e = static_cast<T>(distribution(engine));
+        for (auto& e : b) e = static_cast<T>(distribution(engine));
+        const auto expected = simd::widened_kernels_for<T>(simd::Isa::scalar);
+        const auto actual = simd::widened_active<T>();
+        ASSERT_FLOAT_EQ(actual.l2_sqr(a.data(), b.data(), n), expected.l2_sqr(a.data(), b.data(), n));
+        ASSERT_FLOAT_EQ(actual.l1(a.data(), b.data(), n), expected.l1(a.data(), b.data(), n));
+        ASSERT_FLOAT_EQ(actual.dot(a.data(), b.data(), n), expected.dot(a.data(), b.data(), n));
+    }
+}
+
+TEST(simd, widened) {
+    mt19937 engine(42);
+    check_widened_kernels<uint8_t>(engine);
+    check_widened_kernels<int16_t>(engine);
+    check_widened_kernels<half>(engine);
+
+    for (float value : {0.0f, 1.0f, -2.5f, 0.333251953125f, 65504.0f, 6.103515625e-05f, 5.960464477539063e-08f}) {
+        ASSERT_EQ(static_cast<float>(half(value)), value);
+    }
+    ASSERT_EQ(half(1.0f + 1.0f / 4096).bits, half(1.0f).bits);  // ties to even
+    ASSERT_TRUE(isinf(static_cast<float>(half(1e6f))));
+}
+
+template <typename T>
+void check_element_type() {
+    // small integers, exactly representable in every element type
+    auto series = make_random_series(2000, 20);
+    auto queries = make_random_series(20, 20, 1);
+    for (auto* points : {&series, &queries}) {
+        for (auto& point : *points) {
+            for (auto& e : point.x) e = round(clamp(e * 20 + 100, 0.0f, 255.0f));
+        }
+    }
+    const string path = testing::TempDir() + "vptree_element_type.bin";
+
+    auto vpt = BasicVPTree<Euclidean<T>, T>();
+    vpt.build(series);
+    vpt.save(path);
+    auto loaded = BasicVPTree<Euclidean<T>, T>();
+    loaded.load(path);
+    auto mismatched = VPTree();
+    ASSERT_THROW(mismatched.load(path), runtime_error);
+
+    for (const auto& query : queries) {
+        vector<float> dists;
+        for (const auto& point : series) dists.push_back(euclidean_distance(query, point));
+        sort(dists.begin(), dists.end());
+        const auto range = (dists[50] + dists[51]) / 2;
+        ASSERT_EQ(sorted_ids(vpt.range_search(query, range).series), brute_range_search(series, query, range));
+        for (const auto& result : {vpt.knn_search(query, 10), loaded.knn_search(query, 10)}) {
+            for (int i = 0; i < 10; i++) ASSERT_FLOAT_EQ(result.series[i].dist, dists[i]);
+        }
+    }
+    remove(path.c_str());
+}
+
+TEST(vptree, element_types) {
+    check_element_type<uint8_t>();
+    check_element_type<int16_t>();
+    check_element_type<half>();
+    ASSERT_THROW((BasicVPTree<UnitAngular<uint8_t>, uint8_t>()), runtime_error);
+
+    // integer rows round and saturate
+    auto vpt = BasicVPTree<Euclidean<uint8_t>, uint8_t>();
+    vpt.build(Series<>{Data<>(0, {2.9f, -3, 300}), Data<>(1, {2.4f, NAN, -0.4f})});
+    for (size_t row = 0; row < 2; row++) {
+        const auto expected = vpt.arena.id(row) == 0 ? vector<int>{3, 0, 255} : vector<int>{2, 0, 0};
+        ASSERT_EQ(vector<int>(vpt.arena.row(row), vpt.arena.row(row) + 3), expected);
+    }
+    ASSERT_EQ(saturate_cast<int16_t>(-40000.0f), -32768);
+    ASSERT_EQ(saturate_cast<uint8_t>(int32_t(1000)), 255);
+}
+
+TEST(simd, bounded) {
+    mt19937 engine(42);
+    normal_distribution<float> distribution(0, 1);
+    for (size_t n : {3, 64, 65, 200}) {
+        vector<float> a(n), b(n);
+        for (auto& e : a) e = distribution(engine);
+        for (auto& e : b) e = distribution(engine);
+        const auto l2 = euclidean_distance(a.data(), b.data(), n);
+        const auto l1 = manhattan_distance(a.data(), b.data(), n);
+        ASSERT_NEAR(euclidean_distance_bounded(a.data(), b.data(), n, numeric_limits<float>::infinity()), l2, 1e-4);
+        ASSERT_NEAR(euclidean_distance_bounded(a.data(), b.data(), n, l2 * 1.01f), l2, 1e-4);
+        ASSERT_GE(euclidean_distance_bounded(a.data(), b.data(), n, l2 * 0.5f), l2 * 0.5f);
+        ASSERT_NEAR(manhattan_distance_bounded(a.data(), b.data(), n, l1 * 1.01f), l1, 1e-3);
+        ASSERT_GE(manhattan_distance_bounded(a.data(), b.data(), n, l1 * 0.5f), l1 * 0.5f);
+    }
+}
+
+TEST(vptree, order_dims) {
+    // dimensions with very different scales, so that bounded distances abandon early
+    auto series = make_random_series(2000, 200);
+    auto queries = make_random_series(20, 200, 1);
+    for (auto* points : {&series, &queries}) {
+        for (auto& point : *points) {
+            for (size_t j = 0; j < point.size(); j++) point.x[j] *= 1 + j % 10;
+        }
+    }
+    const string path = testing::TempDir() + "vptree_order_dims.bin";
+
+    auto vpt = VPTree();
+    vpt.order_dims = true;
+    vpt.build(series);
+    ASSERT_EQ(vpt.dim_order.size(), 200);
+    ASSERT_EQ(vpt.dim_order[0] % 10, 9);
+    vpt.save(path);
+    auto loaded = VPTree();
+    loaded.load(path);
+    ASSERT_EQ(loaded.dim_order, vpt.dim_order);
+
+    for (const auto& query : queries) {
+        vector<float> dists;
+        for (const auto& point : series) dists.push_back(euclidean_distance(query, point));
+        sort(dists.begin(), dists.end());
+        const auto range = (dists[50] + dists[51]) / 2;
+        ASSERT_EQ(sorted_ids(vpt.range_search(query, range).series), brute_range_search(series, query, range));
+        for (const auto& result : {vpt.knn_search(query, 10), vpt.knn_search_best_first(query, 10),
+                                   loaded.knn_search(query, 10)}) {
+            for (int i = 0; i < 10; i++) ASSERT_NEAR(result.series[i].dist, dists[i], 1e-3);
+        }
+    }
+    remove(path.c_str());
+}
+
+TEST(vptree, leaf_bucket) {
+    const auto series = make_random_series(500, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const float range = 2.5;
+
+    for (size_t leaf_size : {1, 4, 32, 1000}) {
+        auto vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 42, leaf_size);
+        vpt.build(series);
+        if (leaf_size >= series.size()) {
+            ASSERT_EQ(vpt.nodes.size(), 1);
+        } else if (leaf_size > 1) {
+            ASSERT_LT(vpt.nodes.size(), series.size());
+        }
+
+        for (const auto& query : queries) {
+            const auto result = vpt.range_search(query, range);
+            ASSERT_EQ(sorted_ids(result.series), brute_range_search(series, query, range));
+        }
+    }
+}
+
+template <typename Tree>
+size_t depth(const Tree& vpt, const Node* node) {
+    if (!node) return 0;
+    return 1 + max(depth(vpt, vpt.node_at(node->inner)), depth(vpt, vpt.node_at(node->outer)));
+}
+
+TEST(vptree, balanced) {
+    auto series = make_random_series(1000, 4);
+    for (auto& point : series) point.x[0] = std::exp(4 * point.x[0]);  // skewed distances
+
+    auto vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 42, 1);
+    vpt.build(series);
+
+    ASSERT_EQ(depth(vpt, vpt.root), 10);  // ceil(log2(1001))
+    for (const auto& node : vpt.nodes) {
+        if (node.is_leaf()) continue;
+        const size_t n_inner = node.inner != no_node ? vpt.nodes[node.inner].n_children + 1 : 0;
+        const size_t n_outer = node.outer != no_node ? vpt.nodes[node.outer].n_children + 1 : 0;
+        ASSERT_GE(n_inner, n_outer);
+        ASSERT_LE(n_inner - n_outer, 1);
+    }
+}
+
+TEST(vptree, parallel_build) {
+    const auto series = make_random_series(5000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const float range = 2.5;
+
+    auto vpt = BasicVPTree<Euclidean<>>();
+    vpt.n_threads = 4;
+    vpt.task_cutoff = 64;
+    vpt.build(series);
+
+    ASSERT_EQ(vpt.root, &vpt.nodes[0]);
+    for (const auto& query : queries) {
+        const auto result = vpt.range_search(query, range);
+        ASSERT_EQ(sorted_ids(result.series), brute_range_search(series, query, range));
+    }
+}
+
+TEST(vptree, deterministic_build) {
+    const auto series = make_random_series(5000, 8);
+
+    auto serial_vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 7);
+    serial_vpt.n_threads = 1;
+    serial_vpt.build(series);
+
+    auto parallel_vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 7);
+    parallel_vpt.n_threads = 4;
+    parallel_vpt.task_cutoff = 64;
+    parallel_vpt.build(series);
+
+    ASSERT_EQ(serial_vpt.arena.ids, parallel_vpt.arena.ids);
+    ASSERT_EQ(serial_vpt.nodes.size(), parallel_vpt.nodes.size());
+    for (size_t i = 0; i < serial_vpt.nodes.size(); i++) {
+        ASSERT_EQ(serial_vpt.nodes[i].row, parallel_vpt.nodes[i].row);
+        ASSERT_EQ(serial_vpt.nodes[i].r, parallel_vpt.nodes[i].r);
+    }
+
+    auto other_vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 8);
+    other_vpt.build(series);
+    ASSERT_NE(serial_vpt.arena.ids, other_vpt.arena.ids);
+}
+
+TEST(vptree, range_search_buffer) {
+    const auto series = make_random_series(2000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const float range = 2.5;
+
+    auto vpt = VPTree();
+    vpt.build(series);
+
+    vector<Neighbor> buffer;
+    for (const auto& query : queries) {
+        buffer.clear();
+        vpt.range_search(query, range, buffer);
+        ASSERT_EQ(sorted_ids(buffer), brute_range_search(series, query, range));
+        for (const auto& neighbor : buffer) {
+            ASSERT_FLOAT_EQ(neighbor.dist, euclidean_distance(query, series[neighbor.id]));
+        }
+    }
+}
+
+TEST(vptree, knn_search_brute_force) {
+    const auto series = make_random_series(2000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+
+    auto vpt = VPTree();
+    vpt.build(series);
+
+    for (const auto& query : queries) {
+        vector<float> dists;
+        for (const auto& point : series) dists.push_back(euclidean_distance(query, point));
+        sort(dists.begin(), dists.end());
+
+        for (int k : {1, 10, 100}) {
+            const auto result = vpt.knn_search(query, k);
+            ASSERT_EQ(result.series.size(), k);
+            for (int i = 0; i < k; i++) ASSERT_FLOAT_EQ(result.series[i].dist, dists[i]);
+
+            const auto best_first_result = vpt.knn_search_best_first(query, k);
+            ASSERT_EQ(best_first_result.series.size(), k);
+            for (int i = 0; i < k; i++) ASSERT_FLOAT_EQ(best_first_result.series[i].dist, dists[i]);
+        }
+    }
+}
+
+TEST(vptree, knn_search_ties) {
+    auto series = Series<>();
+    for (size_t i = 0; i < 8; i++) series.push_back(Data<>(i, {1, 0}));
+    series.push_back(Data<>(8, {5, 5}));
+
+    auto vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 42, 1);
+    vpt.build(series);
+
+    const auto result = vpt.knn_search(Data<>(0, {0, 0}), 5);
+    ASSERT_EQ(result.series.size(), 5);
+    for (const auto& neighbor : result.series) ASSERT_EQ(neighbor.dist, 1);
+
+    const auto best_first_result = vpt.knn_search_best_first(Data<>(0, {0, 0}), 5);
+    ASSERT_EQ(best_first_result.series.size(), 5);
+    for (const auto& neighbor : best_first_result.series) ASSERT_EQ(neighbor.dist, 1);
+}
+
+TEST(vptree, batch_search) {
+    const auto series = make_random_series(2000, 8);
+    const auto queries = make_random_series(100, 8, 1);
+
+    auto vpt = VPTree();
+    vpt.n_threads = 4;
+    vpt.build(series);
+
+    const auto range_results = vpt.batch_range_search(queries, 2.5);
+    const auto knn_results = vpt.batch_knn_search(queries, 5);
+    ASSERT_EQ(range_results.size(), queries.size());
+    ASSERT_EQ(knn_results.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        ASSERT_EQ(sorted_ids(range_results[i].series),
+                  sorted_ids(vpt.range_search(queries[i], 2.5).series));
+        ASSERT_EQ(sorted_ids(knn_results[i].series),
+                  sorted_ids(vpt.knn_search(queries[i], 5).series));
+    }
+
+    // an error in one query is rethrown after the parallel region
+    auto mixed = queries;
+    mixed[50].x.pop_back();
+    ASSERT_THROW(vpt.batch_range_search(mixed, 2.5), runtime_error);
+    ASSERT_THROW(vpt.batch_knn_search(mixed, 5), runtime_error);
+}
+
+TEST(vptree, save_and_load) {
+    const auto series = make_random_series(2000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const string path = testing::TempDir() + "vptree_save_and_load.bin";
+
+    auto vpt = VPTree();
+    vpt.source = 1234;
+    vpt.build(series);
+    vpt.save(path);
+
+    auto loaded = VPTree();
+    loaded.load(path);
+    ASSERT_EQ(loaded.source, 1234);
+    ASSERT_EQ(loaded.nodes.size(), vpt.nodes.size());
+    ASSERT_EQ(loaded.arena.ids, vpt.arena.ids);
+    ASSERT_EQ(loaded.pivot_dists, vpt.pivot_dists);
+    for (const auto& query : queries) {
+        ASSERT_EQ(sorted_ids(loaded.range_search(query, 2.5).series),
+                  sorted_ids(vpt.range_search(query, 2.5).series));
+        ASSERT_EQ(sorted_ids(loaded.knn_search(query, 5).series),
+                  sorted_ids(vpt.knn_search(query, 5).series));
+    }
+
+    // an index only loads into a tree with the same metric
+    auto manhattan = VPTree("manhattan");
+    ASSERT_THROW(manhattan.load(path), runtime_error);
+    auto static_manhattan = BasicVPTree<Manhattan<>>();
+    ASSERT_THROW(static_manhattan.load(path), runtime_error);
+    auto static_euclidean = BasicVPTree<Euclidean<>>();
+    static_euclidean.load(path);
+    ASSERT_EQ(static_euclidean.arena.ids, vpt.arena.ids);
+
+    // an empty tree round-trips too
+    const string empty_path = path + ".empty";
+    auto empty = VPTree();
+    empty.build(Series<>());
+    empty.save(empty_path);
+    auto empty_loaded = VPTree();
+    empty_loaded.load(empty_path);
+    ASSERT_EQ(empty_loaded.root, nullptr);
+    ASSERT_TRUE(empty_loaded.range_search(queries[0], 2.5).series.empty());
+    remove(empty_path.c_str());
+
+    // flip one byte of the pivot table
+    {
+        FileHeader header;
+        fstream fs(path, ios::in | ios::out | ios::binary);
+        fs.read(reinterpret_cast<char*>(&header), sizeof(header));
+        ASSERT_GT(header.n_pivots, 0);
+        fs.seekg(header.pivots_offset);
+        const char c = fs.peek();
+        fs.seekp(header.pivots_offset);
+        fs.put(static_cast<char>(c ^ 1));
+    }
+    auto corrupted = VPTree();
+    ASSERT_THROW(corrupted.load(path), runtime_error);
+    remove(path.c_str());
+}
+
+TEST(vptree, load_mapped) {
+    const auto series = make_random_series(2000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const string path = testing::TempDir() + "vptree_map.bin";
+
+    auto vpt = VPTree();
+    vpt.build(series);
+    vpt.save(path);
+
+    for (const bool populate : {false, true}) {
+        auto mapped = VPTree();
+        mapped.load_mapped(path, populate);
+        ASSERT_TRUE(mapped.nodes.empty());
+        ASSERT_EQ(mapped.n_nodes, vpt.n_nodes);
+        ASSERT_NE(as_const(mapped.arena).row(0), nullptr);
+        ASSERT_EQ(mapped.arena.row(0), as_const(mapped.arena).row(0));
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(as_const(mapped.arena).row(0)) % arena_alignment, 0);
+        for (const auto& query : queries) {
+            ASSERT_EQ(sorted_ids(mapped.range_search(query, 2.5).series),
+                      sorted_ids(vpt.range_search(query, 2.5).series));
+            ASSERT_EQ(sorted_ids(mapped.knn_search_best_first(query, 5).series),
+                      sorted_ids(vpt.knn_search(query, 5).series));
+        }
+
+        // a mapped index can be saved again unchanged
+        const string copy_path = path + ".copy";
+        mapped.save(copy_path);
+        auto reloaded = VPTree();
+        reloaded.load(copy_path);
+        ASSERT_EQ(reloaded.arena.ids, vpt.arena.ids);
+        remove(copy_path.c_str());
+    }
+
+    // a tree that fails to map another file keeps searching its current one
+    const string good_path = path + ".good";
+    vpt.save(good_path);
+    auto kept = VPTree();
+    kept.load_mapped(good_path);
+
+    // a child pointing back at the root would loop forever
+    {
+        FileHeader header;
+        fstream fs(path, ios::in | ios::out | ios::binary);
+        fs.read(reinterpret_cast<char*>(&header), sizeof(header));
+        const int64_t root = 0;
+        fs.seekp(header.nodes_offset + offsetof(Node, inner));
+        fs.write(reinterpret_cast<const char*>(&root), sizeof(root));
+    }
+    auto cyclic = VPTree();
+    ASSERT_THROW(cyclic.load_mapped(path), runtime_error);
+    ASSERT_THROW(kept.load_mapped(path), runtime_error);
+    for (const auto& query : queries) {
+        ASSERT_EQ(sorted_ids(kept.range_search(query, 2.5).series), sorted_ids(vpt.range_search(query, 2.5).series));
+    }
+    remove(good_path.c_str());
+
+    // section sizes computed from a huge n wrap around to the real ones
+    vpt.save(path);
+    {
+        FileHeader header;
+        fstream fs(path, ios::in | ios::out | ios::binary);
+        fs.read(reinterpret_cast<char*>(&header), sizeof(header));
+        header.n += uint64_t(1) << 61;
+        fs.seekp(0);
+        fs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    auto oversized = VPTree();
+    ASSERT_THROW(oversized.load_mapped(path), runtime_error);
+    remove(path.c_str());
+}
+
+template <typename V>
+void write_vecs(const string& path, const vector<vector<V>>& rows) {
+    ofstream ofs(path, ios::binary);
+    for (const auto& row : rows) {
+        const int32_t dim = row.size();
+        ofs.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+        ofs.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(V));
+    }
+}
+
+TEST(arailib, read_vecs) {
+    const string fvecs_path = testing::TempDir() + "arailib_read_vecs.fvecs";
+    const string bvecs_path = testing::TempDir() + "arailib_read_vecs.bvecs";
+    const string ivecs_path = testing::TempDir() + "arailib_read_vecs.ivecs";
+    write_vecs<float>(fvecs_path, {{0.5, 1}, {2, 3}, {4, 5.5}});
+    write_vecs<uint8_t>(bvecs_path, {{1, 2, 3}, {250, 251, 252}});
+    write_vecs<int32_t>(ivecs_path, {{7}, {8}, {9}, {10}});
+
+    const auto fvecs = load_data(fvecs_path);
+    ASSERT_EQ(fvecs.size(), 3);
+    ASSERT_EQ(fvecs[2].id, 2);
+    ASSERT_EQ(fvecs[2].x, vector<float>({4, 5.5}));
+    ASSERT_EQ(load_data(fvecs_path, 2).size(), 2);
+    ASSERT_EQ(load_data(fvecs_path, 0).size(), 0);
+
+    const auto bvecs = read_vecs(bvecs_path, 1, 1);
+    ASSERT_EQ(bvecs.size(), 1);
+    ASSERT_EQ(bvecs[0].id, 1);
+    ASSERT_EQ(bvecs[0].x, vector<float>({250, 251, 252}));
+
+    auto reader = VecsReader<int>(ivecs_path);
+    ASSERT_EQ(reader.size(), 4);
+    ASSERT_EQ(reader.dim(), 1);
+    vector<size_t> block_sizes;
+    vector<int> values;
+    reader.for_each_block(3, [&](Series<int>& block) {
+        block_sizes.push_back(block.size());
+        for (const auto& row : block) values.push_back(row[0]);
+    });
+    ASSERT_EQ(block_sizes, vector<size_t>({3, 1}));
+    ASSERT_EQ(values, vector<int>({7, 8, 9, 10}));
+
+    remove(fvecs_path.c_str());
+    remove(bvecs_path.c_str());
+    remove(ivecs_path.c_str());
+}
+
+TEST(arailib, parse_csv) {
+    const string path = testing::TempDir() + "arailib_parse_csv.csv";
+    const auto series = make_random_series(5000, 8);
+    write_csv(fmap([](const Data<>& p) { return p.x; }, series), path);
+
+    const auto matrix = parse_csv(path);
+    const auto expected = read_csv(path, series.size());
+    ASSERT_EQ(matrix.size(), expected.size());
+    ASSERT_EQ(matrix.dim, 8);
+    for (size_t i = 0; i < matrix.size(); i++) {
+        ASSERT_EQ(matrix.ids[i], i);
+        for (size_t j = 0; j < matrix.dim; j++) ASSERT_FLOAT_EQ(matrix.row(i)[j], expected[i][j]);
+    }
+    ASSERT_EQ(parse_csv(path, 10).size(), 10);
+    ASSERT_EQ(load_data(path).size(), series.size());
+    ASSERT_EQ(load_data(path, 0).size(), 0);
+
+    {
+        ofstream ofs(path);
+        ofs << "1, 2\r\n3,+4\r\n5,x\r\n";
+    }
+    ASSERT_THROW(parse_csv(path), runtime_error);
+    const auto head = parse_csv(path, 2);
+    ASSERT_EQ(head.values, vector<float>({1, 2, 3, 4}));
+    remove(path.c_str());
+}
+
+TEST(arailib, read_csv_dir) {
+    const string dir = testing::TempDir() + "arailib_read_csv_dir";
+    mkdir(dir.c_str(), 0755);
+    {
+        ofstream(dir + "/0.csv") << "3,0.5,1\n1,2,3\n";
+        ofstream(dir + "/1.csv") << "";
+        ofstream(dir + "/2.csv") << "0,4,5\n2,6,7";
+    }
+
+    size_t streamed = 0;
+    const auto matrix = read_csv_dir(dir, 3, [&](const Matrix<>& m, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) ASSERT_EQ(m.row(i)[0] > 0, true);
+        streamed += end - begin;
+    });
+    ASSERT_EQ(streamed, 4);
+    ASSERT_EQ(matrix.size(), 4);
+    ASSERT_EQ(matrix.dim, 2);
+    ASSERT_EQ(matrix.ids, vector<size_t>({3, 1, 0, 2}));
+    ASSERT_EQ(matrix.values, vector<float>({0.5, 1, 2, 3, 4, 5, 6, 7}));
+
+    const auto series = load_data(dir, 3);
+    ASSERT_EQ(series.size(), 4);
+    ASSERT_EQ(series[2].id, 0);
+    ASSERT_EQ(load_data(dir).size(), 4);  // every shard
+
+    size_t calls = 0;
+    const auto failing = [&](const Matrix<>&, size_t, size_t) {
+        ++calls;
+        throw bad_alloc();
+    };
+    ASSERT_THROW(read_csv_dir(dir, 3, failing), runtime_error);  // consumer error
+    ASSERT_EQ(calls, 1);
+    ASSERT_THROW(read_csv_dir(dir, 4), runtime_error);  // missing shard
+    ofstream(dir + "/1.csv") << "9,1,x\n";
+    ASSERT_THROW(read_csv_dir(dir, 3), runtime_error);  // malformed line
+
+    for (int i = 0; i < 3; i++) remove((dir + "/" + to_string(i) + ".csv").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST(vptree, build_pipelined) {
+    const string dir = testing::TempDir() + "vptree_build_pipelined";
+    mkdir(dir.c_str(), 0755);
+    const auto series = make_random_series(3000, 8);
+    const int n_shards = 7;
+    for (int i = 0; i < n_shards; i++) {
+        ofstream ofs(dir + "/" + to_string(i) + ".csv");
+        for (size_t j = i; j < series.size(); j += n_shards) {
+            ofs << series[j].id;
+            for (const auto& e : series[j]) ofs << ',' << e;
+            ofs << '\n';
+        }
+    }
+
+    for (const auto selection : {VantageSelection::random, VantageSelection::spread}) {
+        for (const bool order_dims : {false, true}) {
+            auto vpt = VPTree();
+            vpt.vantage_selection = selection;
+            vpt.order_dims = order_dims;
+            vpt.build(dir, n_shards);
+            auto pipelined_vpt = VPTree();
+            pipelined_vpt.vantage_selection = selection;
+            pipelined_vpt.order_dims = order_dims;
+            pipelined_vpt.build_pipelined(dir, n_shards);
+
+            ASSERT_EQ(pipelined_vpt.dim_order, vpt.dim_order);
+            ASSERT_EQ(pipelined_vpt.arena.ids, vpt.arena.ids);
+            ASSERT_EQ(pipelined_vpt.pivot_dists, vpt.pivot_dists);
+            ASSERT_EQ(pipelined_vpt.nodes.size(), vpt.nodes.size());
+            for (size_t i = 0; i < vpt.nodes.size(); i++) {
+                ASSERT_EQ(pipelined_vpt.nodes[i].row, vpt.nodes[i].row);
+                ASSERT_EQ(pipelined_vpt.nodes[i].r, vpt.nodes[i].r);
+                ASSERT_EQ(pipelined_vpt.nodes[i].inner_max, vpt.nodes[i].inner_max);
+            }
+        }
+    }
+    // values are parsed as float and converted in place for other element types
+    auto int16_vpt = BasicVPTree<Euclidean<int16_t>, int16_t>();
+    int16_vpt.build(dir, n_shards);
+    auto pipelined_int16_vpt = BasicVPTree<Euclidean<int16_t>, int16_t>();
+    pipelined_int16_vpt.build_pipelined(dir, n_shards);
+    ASSERT_EQ(pipelined_int16_vpt.arena.ids, int16_vpt.arena.ids);
+    ASSERT_EQ(memcmp(pipelined_int16_vpt.arena.data(), int16_vpt.arena.data(),
+                     int16_vpt.arena.size() * int16_vpt.arena.stride * sizeof(int16_t)), 0);
+
+    // a failed pipelined build leaves an empty tree
+    auto mismatched = BasicVPTree<Euclidean<float, 256>>();
+    mismatched.build(make_random_series(100, 256));
+    ASSERT_THROW(mismatched.build_pipelined(dir, n_shards), runtime_error);
+    ASSERT_EQ(mismatched.root, nullptr);
+    ASSERT_TRUE(mismatched.range_search(make_random_series(1, 256)[0], 100).series.empty());
+    const auto series256 = make_random_series(100, 256);
+    mismatched.build(series256);
+    ASSERT_EQ(sorted_ids(mismatched.range_search(series256[0], 22).series), brute_range_search(series256, series256[0], 22));
+
+    for (int i = 0; i < n_shards; i++) remove((dir + "/" + to_string(i) + ".csv").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST(vptree, spread_vantage_selection) {
+    const auto series = make_random_series(5000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+    const float range = 2.5;
+
+    auto vpt = BasicVPTree<Euclidean<>>();
+    vpt.vantage_selection = VantageSelection::spread;
+    vpt.n_candidates = 4;
+    vpt.n_samples = 16;
+    vpt.task_cutoff = 64;
+    vpt.build(series);
+
+    auto random_vpt = BasicVPTree<Euclidean<>>();
+    random_vpt.build(series);
+    ASSERT_NE(vpt.arena.ids, random_vpt.arena.ids);
+
+    for (const auto& query : queries) {
+        ASSERT_EQ(sorted_ids(vpt.range_search(query, range).series), brute_range_search(series, query, range));
+    }
+}
+
+TEST(vptree, pick_vantage) {
+    // SIFT-scale distances (hundreds), where sum_sq / n and mean^2 nearly cancel
+    auto series = make_random_series(200, 8);
+    for (auto& point : series) {
+        for (auto& e : point.x) e = e * 100 + 500;
+    }
+    auto vpt = BasicVPTree<Euclidean<>>();
+    vpt.arena.assign(series);
+
+    VantageDraw draw;
+    for (size_t i = 0; i < 20; i++) draw.candidates.push_back(i);
+    for (size_t i = 20; i < 200; i++) draw.samples.push_back(i);
+
+    size_t expected = 0;
+    double expected_spread = -1;
+    for (const auto candidate : draw.candidates) {
+        vector<double> dists;
+        for (const auto sample : draw.samples) dists.push_back(vpt.distance(candidate, sample));
+        const double mean = accumulate(dists.begin(), dists.end(), 0.0) / dists.size();
+        double spread = 0;
+        for (const auto dist : dists) spread += (dist - mean) * (dist - mean);
+        if (spread > expected_spread) {
+            expected = candidate;
+            expected_spread = spread;
+        }
+    }
+    ASSERT_EQ(vpt.pick_vantage(draw, [](size_t row) { return row; }), expected);
+}
+
+TEST(vptree, subtree_bounds) {
+    const auto series = make_random_series(3000, 8);
+    auto vpt = BasicVPTree<Euclidean<>>(Euclidean<>(), 42, 4);
+    vpt.build(series);
+
+    const auto subtree_size = [&](int64_t index) -> size_t {
+        if (index == no_node) return 0;
+        const auto& node = vpt.nodes[index];
+        return node.is_leaf() ? node.n_rows : node.n_children + 1;
+    };
+    const auto check = [&](const Node& node, int64_t child, float lo, float hi) {
+        if (child == no_node) return;
+        const auto begin = vpt.nodes[child].row;
+        for (size_t row = begin; row < begin + subtree_size(child); row++) {
+            const auto dist = vpt.distance(node.row, row);
+            ASSERT_GE(dist, lo);
+            ASSERT_LE(dist, hi);
+        }
+    };
+    for (const auto& node : vpt.nodes) {
+        if (node.is_leaf()) continue;
+        ASSERT_EQ(node.inner_max, node.r);
+        ASSERT_LE(node.inner_max, node.outer_min);
+        check(node, node.inner, node.inner_min, node.inner_max);
+        check(node, node.outer, node.outer_min, node.outer_max);
+    }
+}
+
+struct CountingEuclidean {
+    shared_ptr<size_t> count = make_shared<size_t>(0);
+
+    float operator()(const float* p1, const float* p2, size_t n) const {
+        ++*count;
+        return euclidean_distance(p1, p2, n);
+    }
+};
+
+TEST(vptree, pivot_filter) {
+    const auto series = make_random_series(3000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+
+    auto vpt = BasicVPTree<CountingEuclidean>();
+    vpt.build(series);
+    auto unfiltered = BasicVPTree<CountingEuclidean>();
+    unfiltered.n_pivots = 0;
+    unfiltered.build(series);
+
+    // every point has the distance to each of its nearest ancestors
+    const auto check = [&](const auto& self, const Node* node, vector<size_t>& ancestors) -> void {
+        if (!node) return;
+        const auto first = ancestors.size() > vpt.n_pivots ? ancestors.size() - vpt.n_pivots : 0;
+        for (size_t row = node->row; row < node->row + max<size_t>(node->n_rows, 1); row++) {
+            for (size_t a = first; a < ancestors.size(); a++) {
+                ASSERT_FLOAT_EQ(vpt.pivots[row * vpt.n_pivots + a % vpt.n_pivots], vpt.distance(ancestors[a], row));
+            }
+        }
+        if (node->is_leaf()) return;
+        ancestors.push_back(node->row);
+        self(self, vpt.node_at(node->inner), ancestors);
+        self(self, vpt.node_at(node->outer), ancestors);
+        ancestors.pop_back();
+    };
+    vector<size_t> ancestors;
+    check(check, vpt.root, ancestors);
+
+    *vpt.df.count = *unfiltered.df.count = 0;
+    for (const auto& query : queries) {
+        const auto result = vpt.range_search(query, 2.5);
+        ASSERT_EQ(sorted_ids(result.series), brute_range_search(series, query, 2.5));
+        ASSERT_EQ(sorted_ids(result.series), sorted_ids(unfiltered.range_search(query, 2.5).series));
+        for (const bool best_first : {false, true}) {
+            const auto knn = best_first ? vpt.knn_search_best_first(query, 10) : vpt.knn_search(query, 10);
+            const auto expected = unfiltered.knn_search(query, 10);
+            for (int i = 0; i < 10; i++) ASSERT_FLOAT_EQ(knn.series[i].dist, expected.series[i].dist);
+        }
+    }
+    ASSERT_LT(*vpt.df.count, *unfiltered.df.count);
+
+    // n_pivots only applies to the next build; searches keep the layout of the table that was built
+    vpt.n_pivots = 8;
+    for (const auto& query : queries) {
+        ASSERT_EQ(sorted_ids(vpt.range_search(query, 2.5).series), brute_range_search(series, query, 2.5));
+        ASSERT_EQ(sorted_ids(vpt.knn_search_best_first(query, 10).series),
+                  sorted_ids(unfiltered.knn_search(query, 10).series));
+    }
+}
+
+TEST(mvptree, search) {
+    const auto series = make_random_series(3000, 8);
+    const auto queries = make_random_series(20, 8, 1);
+
+    for (size_t m : {2, 3}) {
+        auto mvpt = BasicMVPTree<Euclidean<>>(Euclidean<>(), 42, m, 8);
+        mvpt.build(series);
+        ASSERT_EQ(mvpt.arena.size(), series.size());
+
+        for (const auto& query : queries) {
+            for (float range : {1.5f, 2.5f, 3.5f}) {
+                const auto result = mvpt.range_search(query, range);
+                ASSERT_EQ(sorted_ids(result.series), brute_range_search(series, query, range));
+            }
+
+            vector<float> dists;
+            for (const auto& point : series) dists.push_back(euclidean_distance(query, point));
+            sort(dists.begin(), dists.end());
+            for (int k : {1, 10, 100}) {
+                const auto result = mvpt.knn_search(query, k);
+                ASSERT_EQ(result.series.size(), k);
+                for (int i = 0; i < k; i++) ASSERT_FLOAT_EQ(result.series[i].dist, dists[i]);
+            }
+        }
+    }
+}